@@ -302,9 +302,9 @@ static int libdisplay_width(int pe) {
   if (script_get_value(pe, 0, SCRIPT_ARG_INTEGER, &arg) == 0) {
     ptr = arg.value.i;
 
-    if ((display = ptr_lock(ptr, TAG_DISPLAY)) != NULL) {
+    if ((display = ptr_lock_shared(ptr, TAG_DISPLAY)) != NULL) {
       r = script_push_integer(pe, display->width);
-      ptr_unlock(ptr, TAG_DISPLAY);
+      ptr_unlock_shared(ptr, TAG_DISPLAY);
     }
   }
 
@@ -321,9 +321,9 @@ static int libdisplay_height(int pe) {
   if (script_get_value(pe, 0, SCRIPT_ARG_INTEGER, &arg) == 0) {
     ptr = arg.value.i;
 
-    if ((display = ptr_lock(ptr, TAG_DISPLAY)) != NULL) {
+    if ((display = ptr_lock_shared(ptr, TAG_DISPLAY)) != NULL) {
       r = script_push_integer(pe, display->height);
-      ptr_unlock(ptr, TAG_DISPLAY);
+      ptr_unlock_shared(ptr, TAG_DISPLAY);
     }
   }
 
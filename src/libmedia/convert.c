@@ -13,9 +13,14 @@
 #include "convert.h"
 #include "jpeg.h"
 
+// output buffers kept for reuse, enough for the frames queued downstream
+#define CONVERT_BUFFERS 4
+
 typedef struct {
   int first, encoding, quality, desaturate;
-  unsigned char *yuyv, *rgb, *jpeg;
+  unsigned char *yuyv;
+  media_pool_t *pool;
+  int pool_len;
 } convert_node_t;
 
 static int libmedia_convert_process(media_frame_t *frame, void *data);
@@ -31,6 +36,7 @@ static node_dispatch_t convert_dispatch = {
 static int libmedia_convert_process(media_frame_t *frame, void *_data) {
   convert_node_t *data;
   int i420_len, yuyv_len, gray_len, rgb_len, rgba_len, rgb565_len;
+  media_buffer_t *out, *b;
   unsigned char *buf;
   int len, r = -1;
 
@@ -59,41 +65,61 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
   if (frame->meta.av.v.encoding != data->encoding) {
     if (data->first) {
       data->yuyv = xmalloc(yuyv_len);
-      data->rgb = xmalloc(rgba_len);
       data->first = 0;
     }
     buf = NULL;
     len = -1;
 
+    // the converted frame is written straight into a recycled frame buffer
+    out = NULL;
+    if (frame->meta.av.v.encoding != ENC_JPEG && data->encoding != ENC_JPEG) {
+      switch (data->encoding) {
+        case ENC_I420:  len = i420_len; break;
+        case ENC_GRAY:  len = gray_len; break;
+        case ENC_RGB:   len = rgb_len; break;
+        case ENC_RGBA:  len = rgba_len; break;
+        default:        len = yuyv_len; break;
+      }
+      if (data->pool == NULL || data->pool_len != len) {
+        if (data->pool) media_pool_destroy(data->pool);
+        data->pool = media_pool_create(len, CONVERT_BUFFERS);
+        data->pool_len = len;
+      }
+      if (data->pool == NULL || (out = media_pool_get(data->pool)) == NULL) {
+        return -1;
+      }
+      len = -1;
+    }
+
     switch (frame->meta.av.v.encoding) {
         case ENC_I420:
           switch (data->encoding) {
             case ENC_YUYV:
-              buf = data->yuyv;
+              buf = out->data;
               i420_yuyv(frame->frame, frame->len, buf, frame->meta.av.v.fwidth);
               len = yuyv_len;
               len = frame->meta.av.v.width * frame->meta.av.v.height * 2;
               break;
             case ENC_GRAY:
-              buf = data->rgb;
+              buf = out->data;
               i420_gray(frame->frame, frame->len, buf);
               len = gray_len;
               break;
             case ENC_RGB:
               i420_yuyv(frame->frame, frame->len, data->yuyv, frame->meta.av.v.fwidth);
-              buf = data->rgb;
+              buf = out->data;
               len = rgb_len;
               yuyv_rgb(data->yuyv, yuyv_len, buf);
               break;
             case ENC_RGBA:
               i420_yuyv(frame->frame, frame->len, data->yuyv, frame->meta.av.v.fwidth);
-              buf = data->rgb;
+              buf = out->data;
               len = rgba_len;
               yuyv_rgba(data->yuyv, yuyv_len, buf);
               break;
             case ENC_RGB565:
               i420_yuyv(frame->frame, frame->len, data->yuyv, frame->meta.av.v.fwidth);
-              buf = data->rgb;
+              buf = out->data;
               len = rgb565_len;
               yuyv_rgb565(data->yuyv, yuyv_len, buf);
               break;
@@ -106,27 +132,27 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
         case ENC_YUYV:
           switch (data->encoding) {
             case ENC_I420:
-              buf = data->yuyv;
+              buf = out->data;
               yuyv_i420(frame->frame, frame->len, buf, frame->meta.av.v.fwidth);
               len = i420_len;
               break;
             case ENC_GRAY:
-              buf = data->rgb;
+              buf = out->data;
               yuyv_gray(frame->frame, frame->len, buf);
               len = gray_len;
               break;
             case ENC_RGB:
-              buf = data->rgb;
+              buf = out->data;
               yuyv_rgb(frame->frame, frame->len, buf);
               len = rgb_len;
               break;
             case ENC_RGBA:
-              buf = data->rgb;
+              buf = out->data;
               yuyv_rgba(frame->frame, frame->len, buf);
               len = rgba_len;
               break;
             case ENC_RGB565:
-              buf = data->rgb;
+              buf = out->data;
               yuyv_rgb565(frame->frame, frame->len, buf);
               len = rgb565_len;
               break;
@@ -139,7 +165,7 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
         case ENC_UYVY:
           switch (data->encoding) {
             case ENC_YUYV:
-              buf = data->yuyv;
+              buf = out->data;
               uyvy_yuyv(frame->frame, frame->len, buf);
               len = frame->len;
               break;
@@ -152,23 +178,23 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
         case ENC_GRAY:
           switch (data->encoding) {
             case ENC_YUYV:
-              buf = data->yuyv;
+              buf = out->data;
               gray_yuyv(frame->frame, frame->len, buf);
               len = yuyv_len;
               break;
             case ENC_I420:
               gray_yuyv(frame->frame, frame->len, data->yuyv);
-              buf = data->rgb;
+              buf = out->data;
               len = i420_len;
               yuyv_i420(data->yuyv, yuyv_len, buf, frame->meta.av.v.fwidth);
               break;
             case ENC_RGB:
-              buf = data->rgb;
+              buf = out->data;
               gray_rgb(frame->frame, frame->len, buf);
               len = rgb_len;
               break;
             case ENC_RGBA:
-              buf = data->rgb;
+              buf = out->data;
               gray_rgba(frame->frame, frame->len, buf);
               len = rgba_len;
               break;
@@ -181,32 +207,27 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
         case ENC_RGB:
           switch (data->encoding) {
             case ENC_YUYV:
-              buf = data->yuyv;
+              buf = out->data;
               rgb_yuyv(frame->frame, frame->len, buf);
               len = yuyv_len;
             case ENC_I420:
               rgb_yuyv(frame->frame, frame->len, data->yuyv);
-              buf = data->rgb;
+              buf = out->data;
               len = i420_len;
               yuyv_i420(data->yuyv, yuyv_len, buf, frame->meta.av.v.fwidth);
               break;
             case ENC_GRAY:
-              buf = data->rgb;
+              buf = out->data;
               rgb_gray(frame->frame, frame->len, buf);
               len = gray_len;
               break;
             case ENC_RGBA:
-              buf = data->rgb;
+              buf = out->data;
               rgb_rgba(frame->frame, frame->len, buf);
               len = rgba_len;
               break;
             case ENC_JPEG:
-              if (data->jpeg) {
-                xfree(data->jpeg);
-                data->jpeg = NULL;
-              }
-              data->jpeg = encode_jpeg(frame->frame, frame->meta.av.v.width, frame->meta.av.v.height, frame->meta.av.v.fwidth, frame->meta.av.v.fheight, data->quality, &len);
-              buf = data->jpeg;
+              buf = encode_jpeg(frame->frame, frame->meta.av.v.width, frame->meta.av.v.height, frame->meta.av.v.fwidth, frame->meta.av.v.fheight, data->quality, &len);
               if (buf) {
                 frame->meta.av.v.fwidth = frame->meta.av.v.width;  // jpeglib compression always delivers (width x height) pixels
                 frame->meta.av.v.fheight = frame->meta.av.v.height;
@@ -223,23 +244,23 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
         case ENC_RGBA:
           switch (data->encoding) {
             case ENC_YUYV:
-              buf = data->yuyv;
+              buf = out->data;
               rgba_yuyv(frame->frame, frame->len, buf);
               len = yuyv_len;
               break;
             case ENC_I420:
               rgba_yuyv(frame->frame, frame->len, data->yuyv);
-              buf = data->rgb;
+              buf = out->data;
               len = i420_len;
               yuyv_i420(data->yuyv, yuyv_len, buf, frame->meta.av.v.fwidth);
               break;
             case ENC_GRAY:
-              buf = data->rgb;
+              buf = out->data;
               rgba_gray(frame->frame, frame->len, buf);
               len = gray_len;
               break;
             case ENC_RGB:
-              buf = data->rgb;
+              buf = out->data;
               rgba_rgb(frame->frame, frame->len, buf);
               len = rgb_len;
               break;
@@ -252,12 +273,12 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
         case ENC_BGRA:
           switch (data->encoding) {
             case ENC_RGB:
-              buf = data->rgb;
+              buf = out->data;
               bgra_rgb(frame->frame, frame->len, buf);
               len = rgb_len;
               break;
             case ENC_RGBA:
-              buf = data->rgb;
+              buf = out->data;
               bgra_rgba(frame->frame, frame->len, buf);
               len = rgba_len;
               break;
@@ -291,13 +312,24 @@ static int libmedia_convert_process(media_frame_t *frame, void *_data) {
 
     if (buf && len > 0) {
       frame->meta.av.v.encoding = data->encoding;
-      r = media_frame_put(frame, buf, len);
+      if (out && buf == out->data) {
+        r = media_frame_attach(frame, out, len);
+        out = NULL;
+      } else if ((b = media_buffer_create(buf, len, NULL, NULL)) != NULL) {
+        // JPEG encoder and decoder output is handed over as is
+        r = media_frame_attach(frame, b, len);
+      } else {
+        xfree(buf);
+      }
     } else {
+      if (buf && out == NULL) xfree(buf);
       debug(DEBUG_ERROR, "CONVERT", "invalid source encoding %s", video_encoding_name(frame->meta.av.v.encoding));
     }
+    if (out) media_buffer_release(out);
 
   } else {
     if (data->desaturate) {
+      if (media_frame_own(frame) == -1) return -1;
       switch (data->encoding) {
         case ENC_I420:
           desaturate_i420(frame->frame, i420_len);
@@ -322,8 +354,7 @@ static int libmedia_convert_destroy(void *_data) {
   data = (convert_node_t *)_data;
 
   if (data->yuyv) xfree(data->yuyv);
-  if (data->rgb) xfree(data->rgb);
-  if (data->jpeg) xfree(data->jpeg);
+  if (data->pool) media_pool_destroy(data->pool);
   xfree(data);
 
   return 0;
@@ -79,6 +79,128 @@ static int libmedia_show_node(int pe) {
   return -1;
 }
 
+static int libmedia_broadcast_node(int pe) {
+  script_int_t ptr;
+  int broadcast;
+
+  if (script_get_integer(pe, 0, &ptr) == 0 &&
+      script_get_boolean(pe, 1, &broadcast) == 0) {
+
+    return script_push_boolean(pe, node_broadcast(ptr, broadcast) == 0);
+  }
+
+  return -1;
+}
+
+static int libmedia_stage_node(int pe) {
+  script_int_t ptr, depth;
+  char *policy = NULL;
+  int p, r = -1;
+
+  if (script_get_integer(pe, 0, &ptr) == 0 &&
+      script_get_integer(pe, 1, &depth) == 0) {
+
+    script_opt_string(pe, 2, &policy);
+    if (policy == NULL || !strcmp(policy, "block")) {
+      p = QUEUE_BLOCK;
+    } else if (!strcmp(policy, "drop")) {
+      p = QUEUE_DROP;
+    } else if (!strcmp(policy, "latest")) {
+      p = QUEUE_LATEST;
+    } else {
+      debug(DEBUG_ERROR, "MEDIA", "invalid queue policy \"%s\"", policy);
+      p = -1;
+    }
+
+    if (p != -1) {
+      r = script_push_boolean(pe, node_stage(ptr, depth, p) == 0);
+    }
+  }
+
+  if (policy) xfree(policy);
+
+  return r;
+}
+
+static int libmedia_dropped_node(int pe) {
+  script_int_t ptr;
+  unsigned int dropped;
+
+  if (script_get_integer(pe, 0, &ptr) == 0 && node_dropped(ptr, &dropped) == 0) {
+    return script_push_integer(pe, dropped);
+  }
+
+  return -1;
+}
+
+static void libmedia_set_field(int pe, script_ref_t obj, char *name, int type, script_int_t i, script_real_t d) {
+  script_arg_t key, value;
+
+  key.type = SCRIPT_ARG_STRING;
+  key.value.s = name;
+  value.type = type;
+  if (type == SCRIPT_ARG_INTEGER) {
+    value.value.i = i;
+  } else {
+    value.value.d = d;
+  }
+  script_object_set(pe, obj, &key, &value);
+}
+
+static int libmedia_stats_node(int pe) {
+  script_int_t ptr;
+  script_arg_t key, value;
+  script_ref_t obj, hist;
+  node_stats_t st;
+  int i, r = -1;
+
+  if (script_get_integer(pe, 0, &ptr) == 0 && node_stats(ptr, &st) == 0) {
+    obj = script_create_object(pe);
+    libmedia_set_field(pe, obj, "frames_in", SCRIPT_ARG_REAL, 0, st.frames_in);
+    libmedia_set_field(pe, obj, "frames_out", SCRIPT_ARG_REAL, 0, st.frames_out);
+    libmedia_set_field(pe, obj, "bytes_in", SCRIPT_ARG_REAL, 0, st.bytes_in);
+    libmedia_set_field(pe, obj, "bytes_out", SCRIPT_ARG_REAL, 0, st.bytes_out);
+    libmedia_set_field(pe, obj, "process_total", SCRIPT_ARG_REAL, 0, st.process_total);
+    libmedia_set_field(pe, obj, "process_max", SCRIPT_ARG_REAL, 0, st.process_max);
+    libmedia_set_field(pe, obj, "fps", SCRIPT_ARG_REAL, 0, st.fps);
+    libmedia_set_field(pe, obj, "last_ts", SCRIPT_ARG_INTEGER, st.last_ts, 0);
+    libmedia_set_field(pe, obj, "latency_p50", SCRIPT_ARG_REAL, 0, st.latency_p50);
+    libmedia_set_field(pe, obj, "latency_p90", SCRIPT_ARG_REAL, 0, st.latency_p90);
+    libmedia_set_field(pe, obj, "latency_p99", SCRIPT_ARG_REAL, 0, st.latency_p99);
+    libmedia_set_field(pe, obj, "latency_max", SCRIPT_ARG_REAL, 0, st.latency_max);
+
+    hist = script_create_object(pe);
+    for (i = 0; i < NODE_HIST; i++) {
+      key.type = SCRIPT_ARG_INTEGER;
+      key.value.i = i+1;
+      value.type = SCRIPT_ARG_INTEGER;
+      value.value.i = st.process_hist[i];
+      script_object_set(pe, hist, &key, &value);
+    }
+    key.type = SCRIPT_ARG_STRING;
+    key.value.s = "process_hist";
+    value.type = SCRIPT_ARG_OBJECT;
+    value.value.r = hist;
+    script_object_set(pe, obj, &key, &value);
+    script_remove_ref(pe, hist);
+
+    r = script_push_object(pe, obj);
+    script_remove_ref(pe, obj);
+  }
+
+  return r;
+}
+
+static int libmedia_stats_reset_node(int pe) {
+  script_int_t ptr;
+
+  if (script_get_integer(pe, 0, &ptr) == 0) {
+    return script_push_boolean(pe, node_stats_reset(ptr) == 0);
+  }
+
+  return -1;
+}
+
 static int libmedia_option_node(int pe) {
   char *name = NULL, *value = NULL;
   script_int_t ptr;
@@ -237,6 +359,11 @@ int libmedia_init(int pe, script_ref_t obj) {
   script_add_function(pe, obj, "connect",    libmedia_connect_node);
   script_add_function(pe, obj, "disconnect", libmedia_disconnect_node);
   script_add_function(pe, obj, "show",       libmedia_show_node);
+  script_add_function(pe, obj, "stage",      libmedia_stage_node);
+  script_add_function(pe, obj, "broadcast",  libmedia_broadcast_node);
+  script_add_function(pe, obj, "dropped",    libmedia_dropped_node);
+  script_add_function(pe, obj, "stats",      libmedia_stats_node);
+  script_add_function(pe, obj, "stats_reset", libmedia_stats_reset_node);
   script_add_function(pe, obj, "option",     libmedia_option_node);
   script_add_function(pe, obj, "destroy",    libmedia_destroy_node);
   script_add_function(pe, obj, "play",       libmedia_play);
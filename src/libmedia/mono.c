@@ -85,6 +85,7 @@ static int libmedia_mono_process(media_frame_t *frame, void *_data) {
     debug(DEBUG_INFO, "MONO", "using audio: %s, %d channels, %d Hz", pcm_name(frame->meta.av.a.pcm), frame->meta.av.a.channels, frame->meta.av.a.rate);
   }
 
+  if (media_frame_own(frame) == -1) return -1;
   n = frame->len / data->frame_size;
 
   for (i = 0, j = 0; j < n; j++, i += 2) {
@@ -100,6 +100,7 @@ static int libmedia_pcm_process(media_frame_t *frame, void *_data) {
     }
     dst = data->dst;
   } else {
+    if (media_frame_own(frame) == -1) return -1;
     dst = frame->frame;
   }
 
@@ -252,7 +253,7 @@ static int libmedia_pcm_destroy(void *_data) {
   libmedia_pcm_t *data;
 
   data = (libmedia_pcm_t *)_data;
-  if (data->dst) free(data->dst);
+  if (data->dst) xfree(data->dst);
   xfree(data);
 
   return 0;
@@ -56,7 +56,7 @@ static int stream_getbuf_callback(void *_data, void *_arg) {
 
   if (data->buf && data->len) {
     if (server->buf == NULL) {
-      server->buf = xcalloc(1, data->len);
+      server->buf = xmalloc_raw(data->len);
       if (server->buf) server->alloc = data->len;
     } else if (data->len > server->alloc) {
       server->buf = xrealloc(server->buf, data->len);
@@ -178,7 +178,7 @@ static int libmedia_stream_process(media_frame_t *frame, void *_data) {
   data = (stream_node_t *)_data;
 
   if (data->buf == NULL) {
-    data->buf = xcalloc(1, frame->len);
+    data->buf = xmalloc_raw(frame->len);
     if (data->buf) data->alloc = frame->len;
   } else if (frame->len > data->alloc) {
     data->buf = xrealloc(data->buf, frame->len);
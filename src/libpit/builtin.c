@@ -9,16 +9,20 @@
 
 #include "script.h"
 #include "thread.h"
+#include "mutex.h"
 #include "sys.h"
 #include "timeutc.h"
 #include "pit_io.h"
 #include "vfs.h"
 #include "vfslocal.h"
 #include "sim.h"
+#include "shell.h"
 #include "xalloc.h"
+#include "trace.h"
 #include "debug.h"
 
 static int64_t clock0;
+static int shell_added;
 
 static int pit_sprintf(int pe) {
   char c, fmt[256], buf[1024], lfmt[16], *s;
@@ -274,6 +278,417 @@ PIT_LIB_CODE
   r = 0;
 PIT_LIB_END_B
 
+PIT_LIB_FUNCTION(builtin,sched)
+  PIT_LIB_PARAM_I(handle)
+  PIT_LIB_PARAM_I(cpus)
+  PIT_LIB_PARAM_I(policy)
+  PIT_LIB_PARAM_I(priority)
+  PIT_LIB_PARAM_I(nice)
+  thread_sched_t sched;
+PIT_LIB_CODE
+  sched.cpus = cpus;
+  sched.policy = policy;
+  sched.priority = priority;
+  sched.nice = nice;
+  r = thread_set_sched(handle, &sched);
+PIT_LIB_END_B
+
+PIT_LIB_FUNCTION(builtin,profile)
+  PIT_LIB_PARAM_B(enable)
+PIT_LIB_CODE
+  mutex_profile(enable);
+  r = 0;
+PIT_LIB_END_B
+
+PIT_LIB_FUNCTION(builtin,locks_reset)
+PIT_LIB_CODE
+  mutex_stats_reset();
+  r = 0;
+PIT_LIB_END_B
+
+PIT_LIB_FUNCTION(builtin,trace_start)
+  PIT_LIB_PARAM_I(events)
+PIT_LIB_CODE
+  r = trace_start(events);
+PIT_LIB_END_B
+
+PIT_LIB_FUNCTION(builtin,trace_stop)
+PIT_LIB_CODE
+  r = trace_stop();
+PIT_LIB_END_B
+
+PIT_LIB_FUNCTION(builtin,trace_save)
+  PIT_LIB_PARAM_S(filename)
+PIT_LIB_CODE
+  r = trace_export(filename);
+  PIT_LIB_FREE_S(filename);
+PIT_LIB_END_B
+
+PIT_LIB_FUNCTION(builtin,trace_counter)
+  PIT_LIB_PARAM_S(name)
+  PIT_LIB_PARAM_I(value)
+PIT_LIB_CODE
+  trace_counter("script", name, value);
+  r = 0;
+  PIT_LIB_FREE_S(name);
+PIT_LIB_END_B
+
+static void set_field(int pe, script_ref_t obj, char *name, int type, script_int_t i, script_real_t d, char *s) {
+  script_arg_t key, value;
+
+  key.type = SCRIPT_ARG_STRING;
+  key.value.s = name;
+  value.type = type;
+  switch (type) {
+    case SCRIPT_ARG_INTEGER: value.value.i = i; break;
+    case SCRIPT_ARG_REAL:    value.value.d = d; break;
+    default:                 value.value.s = s; break;
+  }
+  script_object_set(pe, obj, &key, &value);
+}
+
+static int pit_threads(int pe) {
+  thread_stats_t *st;
+  script_ref_t obj, t;
+  script_arg_t key, value;
+  int i, r = -1;
+
+  if ((st = thread_stats()) != NULL) {
+    obj = script_create_object(pe);
+
+    for (i = 0; st[i].tid; i++) {
+      t = script_create_object(pe);
+      set_field(pe, t, "tid", SCRIPT_ARG_INTEGER, st[i].tid, 0, NULL);
+      set_field(pe, t, "handle", SCRIPT_ARG_INTEGER, st[i].handle, 0, NULL);
+      set_field(pe, t, "name", SCRIPT_ARG_STRING, 0, 0, st[i].name);
+      set_field(pe, t, "msgs_in", SCRIPT_ARG_INTEGER, st[i].msgs_in, 0, NULL);
+      set_field(pe, t, "msgs_out", SCRIPT_ARG_INTEGER, st[i].msgs_out, 0, NULL);
+      set_field(pe, t, "queued", SCRIPT_ARG_INTEGER, st[i].queued, 0, NULL);
+      set_field(pe, t, "queued_bytes", SCRIPT_ARG_INTEGER, st[i].queued_bytes, 0, NULL);
+      set_field(pe, t, "wakeups", SCRIPT_ARG_REAL, 0, st[i].wakeups, NULL);
+      set_field(pe, t, "vcsw", SCRIPT_ARG_INTEGER, st[i].vcsw, 0, NULL);
+      set_field(pe, t, "ivcsw", SCRIPT_ARG_INTEGER, st[i].ivcsw, 0, NULL);
+      set_field(pe, t, "cpu", SCRIPT_ARG_REAL, 0, st[i].cpu, NULL);
+      set_field(pe, t, "mutex_wait", SCRIPT_ARG_INTEGER, st[i].mutex_wait, 0, NULL);
+
+      key.type = SCRIPT_ARG_INTEGER;
+      key.value.i = i+1;
+      value.type = SCRIPT_ARG_OBJECT;
+      value.value.r = t;
+      script_object_set(pe, obj, &key, &value);
+      script_remove_ref(pe, t);
+      xfree(st[i].name);
+    }
+    xfree(st);
+
+    r = script_push_object(pe, obj);
+    script_remove_ref(pe, obj);
+  }
+
+  return r;
+}
+
+static int cmd_threads(shell_t *shell, vfs_session_t *session, int pe, int argc, char *argv[], void *data) {
+  shell_provider_t *p = (shell_provider_t *)data;
+  thread_stats_t *st;
+  int i;
+
+  if ((st = thread_stats()) == NULL) {
+    return -1;
+  }
+
+  p->print(shell, 0, "%-6s %-6s %-8s %9s %9s %6s %9s %7s %9s %9s %6s %10s\r\n",
+    "TID", "HANDLE", "NAME", "IN", "OUT", "QUEUE", "QBYTES", "WAKE/S", "VCSW", "IVCSW", "CPU%", "MUTEX_US");
+
+  for (i = 0; st[i].tid; i++) {
+    p->print(shell, 0, "%-6u %-6d %-8s %9llu %9llu %6u %9u %7.1f %9llu %9llu %6.1f %10llu\r\n",
+      st[i].tid, st[i].handle, st[i].name,
+      (unsigned long long)st[i].msgs_in, (unsigned long long)st[i].msgs_out,
+      st[i].queued, st[i].queued_bytes, st[i].wakeups,
+      (unsigned long long)st[i].vcsw, (unsigned long long)st[i].ivcsw,
+      st[i].cpu * 100.0, (unsigned long long)st[i].mutex_wait);
+    xfree(st[i].name);
+  }
+  xfree(st);
+
+  return 0;
+}
+
+static void set_index(int pe, script_ref_t obj, int i, script_ref_t t) {
+  script_arg_t key, value;
+
+  key.type = SCRIPT_ARG_INTEGER;
+  key.value.i = i;
+  value.type = SCRIPT_ARG_OBJECT;
+  value.value.r = t;
+  script_object_set(pe, obj, &key, &value);
+  script_remove_ref(pe, t);
+}
+
+static script_ref_t lock_hist(int pe, uint32_t *hist) {
+  script_arg_t key, value;
+  script_ref_t obj;
+  int i;
+
+  obj = script_create_object(pe);
+  for (i = 0; i < MUTEX_HIST; i++) {
+    key.type = SCRIPT_ARG_INTEGER;
+    key.value.i = i+1;
+    value.type = SCRIPT_ARG_INTEGER;
+    value.value.i = hist[i];
+    script_object_set(pe, obj, &key, &value);
+  }
+
+  return obj;
+}
+
+static script_ref_t lock_sites(int pe, mutex_site_t *worst) {
+  script_ref_t obj, t;
+  int i, n;
+
+  obj = script_create_object(pe);
+  for (i = 0, n = 0; i < MUTEX_WORST; i++) {
+    if (worst[i].file == NULL) continue;
+    t = script_create_object(pe);
+    set_field(pe, t, "file", SCRIPT_ARG_STRING, 0, 0, (char *)worst[i].file);
+    set_field(pe, t, "func", SCRIPT_ARG_STRING, 0, 0, (char *)worst[i].func);
+    set_field(pe, t, "line", SCRIPT_ARG_INTEGER, worst[i].line, 0, NULL);
+    set_field(pe, t, "us", SCRIPT_ARG_REAL, 0, worst[i].us, NULL);
+    set_index(pe, obj, ++n, t);
+  }
+
+  return obj;
+}
+
+static void set_object(int pe, script_ref_t obj, char *name, script_ref_t t) {
+  script_arg_t key, value;
+
+  key.type = SCRIPT_ARG_STRING;
+  key.value.s = name;
+  value.type = SCRIPT_ARG_OBJECT;
+  value.value.r = t;
+  script_object_set(pe, obj, &key, &value);
+  script_remove_ref(pe, t);
+}
+
+static int pit_locks(int pe) {
+  mutex_stats_t *st;
+  script_ref_t obj, t;
+  int i, n, r = -1;
+
+  if ((st = mutex_stats(&n)) != NULL) {
+    obj = script_create_object(pe);
+
+    for (i = 0; i < n; i++) {
+      t = script_create_object(pe);
+      set_field(pe, t, "name", SCRIPT_ARG_STRING, 0, 0, st[i].name);
+      set_field(pe, t, "locks", SCRIPT_ARG_REAL, 0, st[i].locks, NULL);
+      set_field(pe, t, "contended", SCRIPT_ARG_REAL, 0, st[i].contended, NULL);
+      set_field(pe, t, "wait_total", SCRIPT_ARG_REAL, 0, st[i].wait_total, NULL);
+      set_field(pe, t, "wait_max", SCRIPT_ARG_REAL, 0, st[i].wait_max, NULL);
+      set_field(pe, t, "hold_total", SCRIPT_ARG_REAL, 0, st[i].hold_total, NULL);
+      set_field(pe, t, "hold_max", SCRIPT_ARG_REAL, 0, st[i].hold_max, NULL);
+      set_object(pe, t, "wait_hist", lock_hist(pe, st[i].wait_hist));
+      set_object(pe, t, "hold_hist", lock_hist(pe, st[i].hold_hist));
+      set_object(pe, t, "wait_worst", lock_sites(pe, st[i].wait_worst));
+      set_object(pe, t, "hold_worst", lock_sites(pe, st[i].hold_worst));
+      set_index(pe, obj, i+1, t);
+    }
+    xfree(st);
+
+    r = script_push_object(pe, obj);
+    script_remove_ref(pe, obj);
+  }
+
+  return r;
+}
+
+static int pit_memory(int pe) {
+  xalloc_stats_t *st;
+  script_ref_t obj, t;
+  int i, n, r = -1;
+
+  if ((st = xalloc_stats(&n)) != NULL) {
+    obj = script_create_object(pe);
+
+    for (i = 0; i < n; i++) {
+      t = script_create_object(pe);
+      set_field(pe, t, "name", SCRIPT_ARG_STRING, 0, 0, st[i].name);
+      set_field(pe, t, "live", SCRIPT_ARG_REAL, 0, st[i].live, NULL);
+      set_field(pe, t, "peak", SCRIPT_ARG_REAL, 0, st[i].peak, NULL);
+      set_field(pe, t, "allocs", SCRIPT_ARG_REAL, 0, st[i].allocs, NULL);
+      set_field(pe, t, "frees", SCRIPT_ARG_REAL, 0, st[i].frees, NULL);
+      set_field(pe, t, "bytes", SCRIPT_ARG_REAL, 0, st[i].bytes, NULL);
+      set_field(pe, t, "rate", SCRIPT_ARG_REAL, 0, st[i].rate, NULL);
+      set_index(pe, obj, i+1, t);
+    }
+    xfree(st);
+
+    r = script_push_object(pe, obj);
+    script_remove_ref(pe, obj);
+  }
+
+  return r;
+}
+
+static int pit_memory_sites(int pe) {
+  xalloc_site_t *st;
+  script_ref_t obj, t;
+  int i, n, r = -1;
+
+  if ((st = xalloc_sites(&n)) != NULL) {
+    obj = script_create_object(pe);
+
+    for (i = 0; i < n; i++) {
+      t = script_create_object(pe);
+      set_field(pe, t, "name", SCRIPT_ARG_STRING, 0, 0, st[i].name);
+      set_field(pe, t, "file", SCRIPT_ARG_STRING, 0, 0, (char *)st[i].file);
+      set_field(pe, t, "func", SCRIPT_ARG_STRING, 0, 0, (char *)st[i].func);
+      set_field(pe, t, "line", SCRIPT_ARG_INTEGER, st[i].line, 0, NULL);
+      set_field(pe, t, "live", SCRIPT_ARG_REAL, 0, st[i].live, NULL);
+      set_field(pe, t, "count", SCRIPT_ARG_REAL, 0, st[i].count, NULL);
+      set_index(pe, obj, i+1, t);
+    }
+    xfree(st);
+
+    r = script_push_object(pe, obj);
+    script_remove_ref(pe, obj);
+  }
+
+  return r;
+}
+
+static int cmd_memory(shell_t *shell, vfs_session_t *session, int pe, int argc, char *argv[], void *data) {
+  shell_provider_t *p = (shell_provider_t *)data;
+  xalloc_stats_t *st;
+  xalloc_site_t *site;
+  int i, n;
+
+  if (argc == 2) {
+    if (strcmp(argv[1], "sites")) {
+      p->print(shell, 1, "invalid argument %s\r\n", argv[1]);
+      return -1;
+    }
+    if ((site = xalloc_sites(&n)) == NULL) {
+      return -1;
+    }
+    p->print(shell, 0, "%-16s %12s %10s %s\r\n", "NAME", "LIVE", "BLOCKS", "SITE");
+    for (i = 0; i < n; i++) {
+      p->print(shell, 0, "%-16s %12lld %10lld %s:%d (%s)\r\n", site[i].name,
+        (long long)site[i].live, (long long)site[i].count, site[i].file, site[i].line, site[i].func);
+    }
+    xfree(site);
+    return 0;
+  }
+
+  if ((st = xalloc_stats(&n)) == NULL) {
+    return -1;
+  }
+
+  p->print(shell, 0, "%-16s %12s %12s %12s %12s %10s\r\n",
+    "NAME", "LIVE", "PEAK", "ALLOCS", "FREES", "ALLOC/S");
+  for (i = 0; i < n; i++) {
+    p->print(shell, 0, "%-16s %12lld %12lld %12llu %12llu %10.1f\r\n",
+      st[i].name, (long long)st[i].live, (long long)st[i].peak,
+      (unsigned long long)st[i].allocs, (unsigned long long)st[i].frees, st[i].rate);
+  }
+  xfree(st);
+
+  return 0;
+}
+
+static void print_sites(shell_provider_t *p, shell_t *shell, char *what, mutex_site_t *worst) {
+  int i;
+
+  for (i = 0; i < MUTEX_WORST; i++) {
+    if (worst[i].file) {
+      p->print(shell, 0, "  %s %10llu us %s:%d (%s)\r\n", what,
+        (unsigned long long)worst[i].us, worst[i].file, worst[i].line, worst[i].func);
+    }
+  }
+}
+
+static int cmd_locks(shell_t *shell, vfs_session_t *session, int pe, int argc, char *argv[], void *data) {
+  shell_provider_t *p = (shell_provider_t *)data;
+  mutex_stats_t *st;
+  int i, n;
+
+  if (argc == 2) {
+    if (!strcmp(argv[1], "on")) {
+      mutex_profile(1);
+    } else if (!strcmp(argv[1], "off")) {
+      mutex_profile(0);
+    } else if (!strcmp(argv[1], "reset")) {
+      mutex_stats_reset();
+    } else {
+      p->print(shell, 1, "invalid argument %s\r\n", argv[1]);
+      return -1;
+    }
+    return 0;
+  }
+
+  if ((st = mutex_stats(&n)) == NULL) {
+    return -1;
+  }
+
+  p->print(shell, 0, "lock profiling is %s\r\n", mutex_profiling() ? "on" : "off");
+  p->print(shell, 0, "%-16s %10s %10s %12s %10s %12s %10s\r\n",
+    "NAME", "LOCKS", "CONTENDED", "WAIT_US", "WAIT_MAX", "HOLD_US", "HOLD_MAX");
+
+  for (i = 0; i < n; i++) {
+    p->print(shell, 0, "%-16s %10llu %10llu %12llu %10llu %12llu %10llu\r\n",
+      st[i].name, (unsigned long long)st[i].locks, (unsigned long long)st[i].contended,
+      (unsigned long long)st[i].wait_total, (unsigned long long)st[i].wait_max,
+      (unsigned long long)st[i].hold_total, (unsigned long long)st[i].hold_max);
+    print_sites(p, shell, "wait", st[i].wait_worst);
+    print_sites(p, shell, "hold", st[i].hold_worst);
+  }
+  xfree(st);
+
+  return 0;
+}
+
+static int cmd_trace(shell_t *shell, vfs_session_t *session, int pe, int argc, char *argv[], void *data) {
+  shell_provider_t *p = (shell_provider_t *)data;
+
+  if (argc == 2 && !strcmp(argv[1], "start")) {
+    return trace_start(0);
+  }
+  if (argc == 2 && !strcmp(argv[1], "stop")) {
+    return trace_stop();
+  }
+  if (argc == 3 && !strcmp(argv[1], "save")) {
+    return trace_export(argv[2]);
+  }
+
+  p->print(shell, 1, "usage: trace start | stop | save <file>\r\n");
+  return -1;
+}
+
+static shell_command_t shell_commands[] = {
+  { "threads", "threads", 1, 1, cmd_threads, "per thread statistics", NULL },
+  { "locks", "locks [ on | off | reset ]", 1, 2, cmd_locks, "lock contention profile", NULL },
+  { "memory", "memory [ sites ]", 1, 2, cmd_memory, "memory in use per subsystem or allocation site", NULL },
+  { "trace", "trace start | stop | save <file>", 2, 3, cmd_trace, "record trace events", NULL },
+  { NULL, NULL, 0, 0, NULL, NULL, NULL }
+};
+
+// called after each library is loaded, since one of them may provide the shell
+int script_builtin_shell(int pe) {
+  shell_provider_t *p;
+  int i;
+
+  if (!shell_added && (p = script_get_pointer(pe, SHELL_PROVIDER)) != NULL) {
+    for (i = 0; shell_commands[i].name; i++) {
+      shell_commands[i].data = p;
+      p->add(&shell_commands[i]);
+    }
+    shell_added = 1;
+  }
+
+  return 0;
+}
+
 PIT_LIB_BEGIN(builtin)
   PIT_LIB_EXPORT_F(debug);
   PIT_LIB_EXPORT_F(debugbytes);
@@ -294,6 +709,16 @@ PIT_LIB_BEGIN(builtin)
   PIT_LIB_EXPORT_F(usleep);
   PIT_LIB_EXPORT_F(cleanup);
   PIT_LIB_EXPORT_F(finish);
+  PIT_LIB_EXPORT_F(sched);
+  PIT_LIB_EXPORT_F(profile);
+  PIT_LIB_EXPORT_F(locks_reset);
+  PIT_LIB_EXPORT_F(trace_start);
+  PIT_LIB_EXPORT_F(trace_stop);
+  PIT_LIB_EXPORT_F(trace_save);
+  PIT_LIB_EXPORT_F(trace_counter);
+  PIT_LIB_EXPORT_I(SCHED_OTHER, THREAD_SCHED_OTHER);
+  PIT_LIB_EXPORT_I(SCHED_FIFO, THREAD_SCHED_FIFO);
+  PIT_LIB_EXPORT_I(SCHED_RR, THREAD_SCHED_RR);
 PIT_LIB_END
 
 int script_create_builtins(int pe, script_ref_t obj) {
@@ -301,6 +726,10 @@ int script_create_builtins(int pe, script_ref_t obj) {
 
   libbuiltin_init(pe, obj);
   script_add_function(pe, obj, "sprintf", pit_sprintf);
+  script_add_function(pe, obj, "threads", pit_threads);
+  script_add_function(pe, obj, "locks", pit_locks);
+  script_add_function(pe, obj, "memory", pit_memory);
+  script_add_function(pe, obj, "memory_sites", pit_memory_sites);
   script_add_sconst(pe, obj, "SEP", SFILE_SEP);
 
   return 0;
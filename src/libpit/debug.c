@@ -7,6 +7,8 @@
 #include <time.h>
 #include <sys/time.h>
 
+#include <pthread.h>
+
 //#include <android/log.h>
 
 #include "thread.h"
@@ -17,6 +19,38 @@
 #define MAX_BUF 1024
 #define MAX_SYS 32
 
+// In asynchronous mode each thread formats its messages into its own ring of
+// DEBUG_RING bytes, and a writer thread copies the rings to the file. A ring
+// has a single producer and a single consumer, so neither side takes a lock.
+// A message that does not fit in its ring is dropped and counted. At most
+// DEBUG_RINGS rings exist; threads that find no free ring write directly.
+
+#define DEBUG_RINGS 64
+#define DEBUG_RING  (64 * 1024)
+#define DEBUG_IDLE  10000
+
+#define RING_FREE 0
+#define RING_USED 1
+#define RING_DEAD 2
+
+typedef struct {
+  int state;
+  char *buf;
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t tail __attribute__((aligned(64)));
+} debug_ring_t;
+
+typedef struct {
+  uint32_t seq;
+  uint32_t len;
+} debug_record_t;
+
+typedef struct {
+  debug_ring_t *ring;
+  uint32_t head, tail;
+  debug_record_t rec;
+} debug_pending_t;
+
 typedef struct {
   char *sys;
   int level;
@@ -26,12 +60,26 @@ static FILE *fd = NULL;
 static int level = DEBUG_ERROR;
 static debug_sys_t sys_level[MAX_SYS];
 static int nlevels = 0;
+int debug_generation = 1;
 static int show_scope = 0;
 static int indent = 0;
 static int raw = 0;
 
 static char level_name[] = { 'E', 'I', 'T' };
 
+static debug_ring_t rings[DEBUG_RINGS];
+static __thread debug_ring_t *ring __attribute__((tls_model("initial-exec")));
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_t writer;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int async = 0;
+static int writer_stop = 0;
+static uint32_t seq = 0;
+static uint32_t dropped = 0;
+static uint32_t reported = 0;
+
 int debug_init(char *filename) {
   if (filename) {
     if (!strcmp(filename, "stdout")) fd = stdout;
@@ -45,6 +93,8 @@ int debug_init(char *filename) {
 }
 
 int debug_close(void) {
+  debug_async(0);
+
   if (fd && fd != stderr && fd != stdout) {
     fclose(fd);
     fd = NULL;
@@ -53,6 +103,200 @@ int debug_close(void) {
   return 0;
 }
 
+static void debug_ring_release(void *value) {
+  debug_ring_t *r = (debug_ring_t *)value;
+
+  // the writer drains the ring before handing it to another thread
+  if (r) __atomic_store_n(&r->state, RING_DEAD, __ATOMIC_RELEASE);
+}
+
+static void debug_ring_init(void) {
+  pthread_key_create(&ring_key, debug_ring_release);
+}
+
+static debug_ring_t *debug_ring_get(void) {
+  debug_ring_t *r;
+  int i, state;
+
+  pthread_once(&ring_once, debug_ring_init);
+
+  for (i = 0; i < DEBUG_RINGS; i++) {
+    r = &rings[i];
+    state = RING_FREE;
+    if (__atomic_compare_exchange_n(&r->state, &state, RING_USED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      if (r->buf == NULL && (r->buf = malloc(DEBUG_RING)) == NULL) {
+        __atomic_store_n(&r->state, RING_FREE, __ATOMIC_RELEASE);
+        return NULL;
+      }
+      pthread_setspecific(ring_key, r);
+      ring = r;
+      return r;
+    }
+  }
+
+  return NULL;
+}
+
+static void debug_ring_copy(debug_ring_t *r, uint32_t pos, void *buf, uint32_t len, int in) {
+  uint32_t off, n;
+
+  off = pos & (DEBUG_RING - 1);
+  n = DEBUG_RING - off;
+  if (n > len) n = len;
+
+  if (in) {
+    memcpy(r->buf + off, buf, n);
+    if (n < len) memcpy(r->buf, (char *)buf + n, len - n);
+  } else {
+    memcpy(buf, r->buf + off, n);
+    if (n < len) memcpy((char *)buf + n, r->buf, len - n);
+  }
+}
+
+static int debug_ring_put(char *buf, uint32_t len) {
+  debug_ring_t *r;
+  debug_record_t rec;
+  uint32_t head, tail;
+
+  if ((r = ring) == NULL && (r = debug_ring_get()) == NULL) {
+    return -1;
+  }
+
+  head = r->head;
+  tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+  if (DEBUG_RING - (head - tail) < sizeof(rec) + len) {
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  rec.seq = __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED);
+  rec.len = len;
+  debug_ring_copy(r, head, &rec, sizeof(rec), 1);
+  debug_ring_copy(r, head + sizeof(rec), buf, len, 1);
+  __atomic_store_n(&r->head, head + sizeof(rec) + len, __ATOMIC_RELEASE);
+
+  // wake the writer early only when the ring crosses half of its size
+  if (head - tail < DEBUG_RING / 2 && head - tail + sizeof(rec) + len >= DEBUG_RING / 2) {
+    pthread_cond_signal(&writer_cond);
+  }
+
+  return 0;
+}
+
+// Writes the messages queued in all rings, merged in the order they were
+// logged.
+static uint32_t debug_drain(void) {
+  debug_pending_t pending[DEBUG_RINGS], *p;
+  debug_ring_t *r;
+  uint32_t off, n, total, d;
+  char buf[64];
+  int i, j, state, npending;
+
+  for (i = 0, npending = 0; i < DEBUG_RINGS; i++) {
+    r = &rings[i];
+    state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+    if (state == RING_FREE) continue;
+
+    p = &pending[npending];
+    p->head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    p->tail = r->tail;
+
+    if (p->head != p->tail) {
+      p->ring = r;
+      debug_ring_copy(r, p->tail, &p->rec, sizeof(p->rec), 0);
+      npending++;
+    } else if (state == RING_DEAD) {
+      __atomic_store_n(&r->state, RING_FREE, __ATOMIC_RELEASE);
+    }
+  }
+
+  sys_lockfile(fd);
+
+  for (total = 0; npending > 0;) {
+    for (i = 1, j = 0; i < npending; i++) {
+      if ((int32_t)(pending[i].rec.seq - pending[j].rec.seq) < 0) j = i;
+    }
+    p = &pending[j];
+    r = p->ring;
+
+    off = (p->tail + sizeof(p->rec)) & (DEBUG_RING - 1);
+    n = DEBUG_RING - off;
+    if (n > p->rec.len) n = p->rec.len;
+    fwrite(r->buf + off, 1, n, fd);
+    if (n < p->rec.len) fwrite(r->buf, 1, p->rec.len - n, fd);
+    total += p->rec.len;
+
+    p->tail += sizeof(p->rec) + p->rec.len;
+    __atomic_store_n(&r->tail, p->tail, __ATOMIC_RELEASE);
+
+    if (p->tail == p->head) {
+      pending[j] = pending[--npending];
+    } else {
+      debug_ring_copy(r, p->tail, &p->rec, sizeof(p->rec), 0);
+    }
+  }
+
+  d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (d != reported) {
+    n = snprintf(buf, sizeof(buf), "DEBUG: %u messages dropped%s\n", d - reported, raw ? "\r" : "");
+    fwrite(buf, 1, n, fd);
+    reported = d;
+    total += n;
+  }
+
+  if (total) fflush(fd);
+  sys_unlockfile(fd);
+
+  return total;
+}
+
+static void *debug_writer(void *arg) {
+  struct timespec ts;
+
+  sys_block_signals();
+  sys_set_thread_name("LOG");
+
+  while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+    if (debug_drain() == 0) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += DEBUG_IDLE * 1000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&writer_mutex);
+      pthread_cond_timedwait(&writer_cond, &writer_mutex, &ts);
+      pthread_mutex_unlock(&writer_mutex);
+    }
+  }
+
+  return NULL;
+}
+
+int debug_async(int enable) {
+  if (enable && !async) {
+    if (fd == NULL) return -1;
+    writer_stop = 0;
+    if (pthread_create(&writer, NULL, debug_writer, NULL) != 0) {
+      return -1;
+    }
+    __atomic_store_n(&async, 1, __ATOMIC_RELEASE);
+  } else if (!enable && async) {
+    __atomic_store_n(&async, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&writer_cond);
+    pthread_join(writer, NULL);
+    debug_drain();
+  }
+
+  return 0;
+}
+
+unsigned int debug_dropped(void) {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
 void debug_aindent(int i) {
   indent = i;
 }
@@ -76,6 +320,7 @@ void debug_setsyslevel(char *sys, int _level) {
       if (sys_level[i].sys != NULL) {
         if (!strcmp(sys_level[i].sys, sys)) {
           sys_level[i].level = _level;
+          __atomic_add_fetch(&debug_generation, 1, __ATOMIC_RELEASE);
           return;
         }
       }
@@ -89,6 +334,8 @@ void debug_setsyslevel(char *sys, int _level) {
   } else {
     level = _level;
   }
+
+  __atomic_add_fetch(&debug_generation, 1, __ATOMIC_RELEASE);
 }
 
 int debug_getsyslevel(char *sys) {
@@ -107,6 +354,16 @@ int debug_getsyslevel(char *sys) {
   return level;
 }
 
+int debug_cache_level(int *cache, const char *sys) {
+  int generation, value;
+
+  generation = __atomic_load_n(&debug_generation, __ATOMIC_ACQUIRE);
+  value = (generation << 2) | debug_getsyslevel((char *)sys);
+  __atomic_store_n(cache, value, __ATOMIC_RELAXED);
+
+  return value;
+}
+
 void debug_scope(int show) {
   show_scope = show;
 }
@@ -147,6 +404,7 @@ int str(char *buf, int d, char *s, int max) {
   return i;
 }
 
+// the level was already checked by the caller, see debug_on
 void debugva_full(const char *file, const char *func, int line, int _level, const char *sys, const char *fmt, va_list ap) {
   char tmp[MAX_BUF], buf[MAX_BUF], *s;
   int i, j, k, ms;
@@ -158,89 +416,102 @@ void debugva_full(const char *file, const char *func, int line, int _level, cons
   if (_level < DEBUG_ERROR) _level = DEBUG_ERROR;
   if (_level > DEBUG_TRACE) _level = DEBUG_TRACE;
 
-  if (_level <= debug_getsyslevel((char *)sys)) {
-    vsnprintf(tmp, sizeof(tmp)-1, fmt, ap);
-
-    for (i = 0, j = 0; tmp[i] && j < MAX_BUF-5; i++) {
-      if (tmp[i] >= 32) {
-        buf[j++] = tmp[i];
-      } else if (tmp[i+1]) {
-        buf[j++] = '<';
-        buf[j++] = hex((tmp[i] >> 4) & 0x0F);
-        buf[j++] = hex(tmp[i] & 0x0F);
-        buf[j++] = '>';
-      }
-    }
-    buf[j] = 0;
-
-    thread_get_name(thread_name, sizeof(thread_name));
-
-    timeofday(&tv);
-    ts = tv.tv_sec;
-    ms = tv.tv_usec / 1000;
-    utctime(&ts, &tm);
+  vsnprintf(tmp, sizeof(tmp)-1, fmt, ap);
 
-    s = tmp;
-    s += dec(tm.tm_year + 1900, 4, s, tmp + MAX_BUF - s);
-    s += ch('-', s, tmp + MAX_BUF - s);
-    s += dec(tm.tm_mon + 1, 2, s, tmp + MAX_BUF - s);
-    s += ch('-', s, tmp + MAX_BUF - s);
-    s += dec(tm.tm_mday, 2, s, tmp + MAX_BUF - s);
-    s += ch(' ', s, tmp + MAX_BUF - s);
-    s += dec(tm.tm_hour, 2, s, tmp + MAX_BUF - s);
-    s += ch(':', s, tmp + MAX_BUF - s);
-    s += dec(tm.tm_min, 2, s, tmp + MAX_BUF - s);
-    s += ch(':', s, tmp + MAX_BUF - s);
-    s += dec(tm.tm_sec, 2, s, tmp + MAX_BUF - s);
-    s += ch('.', s, tmp + MAX_BUF - s);
-    s += dec(ms, 3, s, tmp + MAX_BUF - s);
-    s += ch(' ', s, tmp + MAX_BUF - s);
-    s += ch(level_name[_level], s, tmp + MAX_BUF - s);
-    s += ch(' ', s, tmp + MAX_BUF - s);
-    s += dec(sys_get_tid(), 5, s, tmp + MAX_BUF - s);
+  for (i = 0, j = 0; tmp[i] && j < MAX_BUF-5; i++) {
+    if (tmp[i] >= 32) {
+      buf[j++] = tmp[i];
+    } else if (tmp[i+1]) {
+      buf[j++] = '<';
+      buf[j++] = hex((tmp[i] >> 4) & 0x0F);
+      buf[j++] = hex(tmp[i] & 0x0F);
+      buf[j++] = '>';
+    }
+  }
+  buf[j] = 0;
+
+  thread_get_name(thread_name, sizeof(thread_name));
+
+  timeofday(&tv);
+  ts = tv.tv_sec;
+  ms = tv.tv_usec / 1000;
+  utctime(&ts, &tm);
+
+  s = tmp;
+  s += dec(tm.tm_year + 1900, 4, s, tmp + MAX_BUF - s);
+  s += ch('-', s, tmp + MAX_BUF - s);
+  s += dec(tm.tm_mon + 1, 2, s, tmp + MAX_BUF - s);
+  s += ch('-', s, tmp + MAX_BUF - s);
+  s += dec(tm.tm_mday, 2, s, tmp + MAX_BUF - s);
+  s += ch(' ', s, tmp + MAX_BUF - s);
+  s += dec(tm.tm_hour, 2, s, tmp + MAX_BUF - s);
+  s += ch(':', s, tmp + MAX_BUF - s);
+  s += dec(tm.tm_min, 2, s, tmp + MAX_BUF - s);
+  s += ch(':', s, tmp + MAX_BUF - s);
+  s += dec(tm.tm_sec, 2, s, tmp + MAX_BUF - s);
+  s += ch('.', s, tmp + MAX_BUF - s);
+  s += dec(ms, 3, s, tmp + MAX_BUF - s);
+  s += ch(' ', s, tmp + MAX_BUF - s);
+  s += ch(level_name[_level], s, tmp + MAX_BUF - s);
+  s += ch(' ', s, tmp + MAX_BUF - s);
+  s += dec(sys_get_tid(), 5, s, tmp + MAX_BUF - s);
+  s += ch(' ', s, tmp + MAX_BUF - s);
+  s += str(thread_name, 8, s, tmp + MAX_BUF - s);
+  s += ch(' ', s, tmp + MAX_BUF - s);
+  s += str((char *)sys, -1, s, tmp + MAX_BUF - s);
+  s += ch(':', s, tmp + MAX_BUF - s);
+  s += ch(' ', s, tmp + MAX_BUF - s);
+  for (k = 0; k < indent; k++) {
     s += ch(' ', s, tmp + MAX_BUF - s);
-    s += str(thread_name, 8, s, tmp + MAX_BUF - s);
+  }
+  s += str(buf, -1, s, tmp + MAX_BUF - s);
+  if (show_scope) {
     s += ch(' ', s, tmp + MAX_BUF - s);
-    s += str((char *)sys, -1, s, tmp + MAX_BUF - s);
+    s += ch('[', s, tmp + MAX_BUF - s);
+    s += str((char *)file, -1, s, tmp + MAX_BUF - s);
     s += ch(':', s, tmp + MAX_BUF - s);
-    s += ch(' ', s, tmp + MAX_BUF - s);
-    for (k = 0; k < indent; k++) {
-      s += ch(' ', s, tmp + MAX_BUF - s);
-    }
-    s += str(buf, -1, s, tmp + MAX_BUF - s);
-    if (show_scope) {
-      s += ch(' ', s, tmp + MAX_BUF - s);
-      s += ch('[', s, tmp + MAX_BUF - s);
-      s += str((char *)file, -1, s, tmp + MAX_BUF - s);
-      s += ch(':', s, tmp + MAX_BUF - s);
-      s += str((char *)func, -1, s, tmp + MAX_BUF - s);
-      s += ch(':', s, tmp + MAX_BUF - s);
-      s += dec(line, 4, s, tmp + MAX_BUF - s);
-      s += ch(']', s, tmp + MAX_BUF - s);
-    }
-    if (raw) s += ch('\r', s, tmp + MAX_BUF - s);
-    s += ch('\n', s, tmp + MAX_BUF - s);
-    *s = 0;
+    s += str((char *)func, -1, s, tmp + MAX_BUF - s);
+    s += ch(':', s, tmp + MAX_BUF - s);
+    s += dec(line, 4, s, tmp + MAX_BUF - s);
+    s += ch(']', s, tmp + MAX_BUF - s);
+  }
+  if (raw) s += ch('\r', s, tmp + MAX_BUF - s);
+  s += ch('\n', s, tmp + MAX_BUF - s);
+  *s = 0;
 
 /*
-    switch (_level) {
-      case DEBUG_TRACE: _level = ANDROID_LOG_INFO; break;
-      case DEBUG_INFO:  _level = ANDROID_LOG_INFO; break;
-      case DEBUG_ERROR: _level = ANDROID_LOG_ERROR; break;
-      default: _level = ANDROID_LOG_INFO;
-    }
+  switch (_level) {
+    case DEBUG_TRACE: _level = ANDROID_LOG_INFO; break;
+    case DEBUG_INFO:  _level = ANDROID_LOG_INFO; break;
+    case DEBUG_ERROR: _level = ANDROID_LOG_ERROR; break;
+    default: _level = ANDROID_LOG_INFO;
+  }
 */
-    sys_lockfile(fd);
-    //__android_log_buf_write(LOG_ID_MAIN, _level, "pit", tmp);
-    fwrite((uint8_t *)tmp, 1, s - tmp, fd);
-    fflush(fd);
-    sys_unlockfile(fd);
+  if (__atomic_load_n(&async, __ATOMIC_ACQUIRE) && debug_ring_put(tmp, s - tmp) == 0) {
+    return;
   }
+
+  sys_lockfile(fd);
+  //__android_log_buf_write(LOG_ID_MAIN, _level, "pit", tmp);
+  fwrite((uint8_t *)tmp, 1, s - tmp, fd);
+  fflush(fd);
+  sys_unlockfile(fd);
 }
 
+// for callers that do not go through debug_on
 void debug_full(const char *file, const char *func, int line, int _level, const char *sys, const char *fmt, ...) {
   va_list ap;
 
+  if (_level <= debug_getsyslevel((char *)sys)) {
+    va_start(ap, fmt);
+    debugva_full(file, func, line, _level, sys, fmt, ap);
+    va_end(ap);
+  }
+}
+
+void debug_out(const char *file, const char *func, int line, int _level, const char *sys, const char *fmt, ...) {
+  va_list ap;
+
   va_start(ap, fmt);
   debugva_full(file, func, line, _level, sys, fmt, ap);
   va_end(ap);
@@ -281,7 +552,7 @@ void debug_bytes_full(const char *file, const char *func, int line, int level, c
     j++;
     if (j == 16) {
       *p = 0;
-      debug_full(file, func, line, level, sys, sbuf);
+      debug_out(file, func, line, level, sys, "%s", sbuf);
       p = sbuf;
       sprintf(p, "%04X: ", i+1);
       n = strlen(p);
@@ -293,6 +564,6 @@ void debug_bytes_full(const char *file, const char *func, int line, int level, c
   *p = 0;
 
   if (j) {
-    debug_full(file, func, line, level, sys, sbuf);
+    debug_out(file, func, line, level, sys, "%s", sbuf);
   }
 }
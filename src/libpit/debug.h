@@ -9,14 +9,30 @@ extern "C" {
 #define DEBUG_INFO  1
 #define DEBUG_TRACE 2
 
+// Highest level compiled in. With PIT_NO_TRACE, TRACE calls are removed from
+// the build together with the evaluation of their arguments.
+#ifdef PIT_NO_TRACE
+#define DEBUG_MAX DEBUG_INFO
+#else
+#define DEBUG_MAX DEBUG_TRACE
+#endif
+
+extern int debug_generation;
+
 int debug_init(char *filename);
 
 int debug_close(void);
 
+int debug_async(int enable);
+
+unsigned int debug_dropped(void);
+
 void debug_setsyslevel(char *sys, int level);
 
 int debug_getsyslevel(char *sys);
 
+int debug_cache_level(int *cache, const char *sys);
+
 void debug_scope(int show);
 
 void debug_aindent(int i);
@@ -35,13 +51,29 @@ void debugva_full(const char *file, const char *func, int line, int level, const
 void debug_full(const char *file, const char *func, int line, int level, const char *sys,
                 const char *fmt, ...);
 
+void debug_out(const char *file, const char *func, int line, int level, const char *sys,
+               const char *fmt, ...);
+
 void debug_bytes_full(const char *file, const char *func, int line, int level, const char *sys,
                       unsigned char *buf, int len);
 
+// Levels are checked before the arguments are evaluated. Each call site
+// caches the level of its subsystem along with debug_generation, and looks it
+// up again only after debug_setsyslevel() has changed the levels. Messages
+// that passed debug_on are written by debug_out and debugva_full, which do
+// not check the level again.
+#define debug_on(level, sys) ((level) <= DEBUG_MAX && ({ \
+  static int _debug_cache; \
+  int _debug_level = __atomic_load_n(&_debug_cache, __ATOMIC_RELAXED); \
+  if ((_debug_level >> 2) != __atomic_load_n(&debug_generation, __ATOMIC_RELAXED)) \
+    _debug_level = debug_cache_level(&_debug_cache, sys); \
+  (level) <= (_debug_level & 3); }))
+
 #define debug_errno(sys, fmt, args...)    debug_errno_full(__FILE__, __FUNCTION__, __LINE__, sys, fmt, ##args)
-#define debugva(level, sys, fmt, args...) debugva_full(__FILE__, __FUNCTION__, __LINE__, level, sys, fmt, ##args)
-#define debug(level, sys, fmt, args...)   debug_full(__FILE__, __FUNCTION__, __LINE__, level, sys, fmt, ##args)
-#define debug_bytes(level, sys, buf, len) debug_bytes_full(__FILE__, __FUNCTION__, __LINE__, level, sys, buf, len);
+#define debugva(level, sys, fmt, args...) do { if (debug_on(level, sys)) debugva_full(__FILE__, __FUNCTION__, __LINE__, level, sys, fmt, ##args); } while (0)
+#define debug(level, sys, fmt, args...)   do { if (debug_on(level, sys)) debug_out(__FILE__, __FUNCTION__, __LINE__, level, sys, fmt, ##args); } while (0)
+#define debug_bytes(level, sys, buf, len) do { if (debug_on(level, sys)) debug_bytes_full(__FILE__, __FUNCTION__, __LINE__, level, sys, buf, len); } while (0)
+#define debug_at(file, func, line, level, sys, fmt, args...) do { if (debug_on(level, sys)) debug_out(file, func, line, level, sys, fmt, ##args); } while (0)
 
 #ifdef __cplusplus
 }
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #include "ptr.h"
 #include "thread.h"
 #include "timeutc.h"
+#include "trace.h"
 #include "debug.h"
 #include "xalloc.h"
 
@@ -63,6 +65,23 @@ typedef struct {
   unsigned char buf;
 } io_write_arg_t;
 
+static char *event_name[] = {
+  "", "bind", "bind_error", "accept", "connect", "connect_error",
+  "disconnect", "data", "line", "timeout", "close", "cmd", "timer"
+};
+
+static int io_callback(io_callback_f callback, int event, io_addr_t *addr, unsigned char *buf, int len, int fd, int handle, void **data) {
+  char *name;
+  int r;
+
+  name = event >= 0 && event <= IO_TIMER ? event_name[event] : "event";
+  trace_begin("io", name);
+  r = callback(event, addr, buf, len, fd, handle, data);
+  trace_end("io", name);
+
+  return r;
+}
+
 static int line(io_connection_t *con, int n, int handle) {
   int i;
 
@@ -73,7 +92,7 @@ static int line(io_connection_t *con, int n, int handle) {
         con->pos--;
         con->reply[con->pos] = 0;
       }
-      if (con->callback(IO_LINE, &con->addr, con->reply, con->pos, con->fd, handle, &con->data)) {
+      if (io_callback(con->callback, IO_LINE, &con->addr, con->reply, con->pos, con->fd, handle, &con->data)) {
         return 1;
       }
       con->pos = 0;
@@ -197,13 +216,13 @@ static int io_connection_loop(io_connection_t *con, int handle) {
 
   if (con->fd == -1 && con->connect && t > con->next_try) {
     if ((con->fd = io_connect_addr(con->has_src ? &con->src : NULL, &con->addr, con->bt)) != -1) {
-      if (con->callback(IO_CONNECT, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
+      if (io_callback(con->callback, IO_CONNECT, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
         debug(DEBUG_INFO, "IO", "exiting on connect callback");
         return -1;
       }
 
     } else {
-      if (con->callback(IO_CONNECT_ERROR, &con->addr, NULL, 0, -1, handle, &con->data)) {
+      if (io_callback(con->callback, IO_CONNECT_ERROR, &con->addr, NULL, 0, -1, handle, &con->data)) {
         debug(DEBUG_INFO, "IO", "exiting on connection error callback");
         return -1;
       }
@@ -220,7 +239,7 @@ static int io_connection_loop(io_connection_t *con, int handle) {
 
   if (r == 1) {
     if (buf) {
-      if (con->callback(IO_CMD, &con->addr, buf, n, con->fd, handle, &con->data) == 0) {
+      if (io_callback(con->callback, IO_CMD, &con->addr, buf, n, con->fd, handle, &con->data) == 0) {
         // if IO_CMD returns == 0, send data directly to device
         if (con->fd != -1) {
           if (sys_write(con->fd, buf, n) != n) {
@@ -265,7 +284,7 @@ static int io_connection_loop(io_connection_t *con, int handle) {
     }
     con->reading = 1;
     con->lastdata = t;
-    if (con->callback(IO_DATA, &con->addr, con->buffer, nread, con->fd, handle, &con->data)) {
+    if (io_callback(con->callback, IO_DATA, &con->addr, con->buffer, nread, con->fd, handle, &con->data)) {
       debug(DEBUG_INFO, "IO", "exiting on data callback");
       return -1;
     }
@@ -274,7 +293,7 @@ static int io_connection_loop(io_connection_t *con, int handle) {
     // nothing to read
 
     if (con->timer) {
-      if (con->callback(IO_TIMER, &con->addr, NULL, 0, -1, handle, &con->data)) {
+      if (io_callback(con->callback, IO_TIMER, &con->addr, NULL, 0, -1, handle, &con->data)) {
         return 1;
       }
     }
@@ -282,7 +301,7 @@ static int io_connection_loop(io_connection_t *con, int handle) {
     if (con->reading) {
       con->reading = 0;
 /* XXX do not send empty string
-      if (con->callback(IO_DATA, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
+      if (io_callback(con->callback, IO_DATA, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
         debug(DEBUG_INFO, "IO", "exiting on data callback");
         return -1;
       }
@@ -291,7 +310,7 @@ static int io_connection_loop(io_connection_t *con, int handle) {
 
     if (con->timeout && con->lastdata && (t - con->lastdata) > con->timeout) {
       debug(DEBUG_INFO, "IO", "timeout (%d - %d) > %d", t, con->lastdata, con->timeout);
-      if (con->callback(IO_TIMEOUT, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
+      if (io_callback(con->callback, IO_TIMEOUT, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
         debug(DEBUG_INFO, "IO", "exiting on timeout callback");
         return -1;
       }
@@ -309,7 +328,7 @@ static int io_connection_action(void *arg) {
   handle = thread_get_handle();
 
   if (!con->connect) {
-    if (con->callback(IO_ACCEPT, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
+    if (io_callback(con->callback, IO_ACCEPT, &con->addr, NULL, 0, con->fd, handle, &con->data)) {
       debug(DEBUG_INFO, "IO", "exiting on accept callback");
       if (con->fd != -1) sys_close(con->fd);
       xfree(con);
@@ -321,7 +340,7 @@ static int io_connection_action(void *arg) {
     if (io_connection_loop(con, handle)) break;
   }
 
-  con->callback(IO_DISCONNECT, &con->addr, NULL, 0, con->fd, handle, &con->data);
+  io_callback(con->callback, IO_DISCONNECT, &con->addr, NULL, 0, con->fd, handle, &con->data);
   if (con->end) {
     thread_end(con->tag, handle);
   }
@@ -334,11 +353,24 @@ static int io_connection_action(void *arg) {
   return 0;
 }
 
+// the buffers are always written before they are read, so only the fields
+// around them are cleared
+static void *io_alloc(size_t size, size_t buf_offset, size_t buf_len) {
+  uint8_t *p;
+
+  if ((p = xmalloc_raw(size)) != NULL) {
+    xmemset(p, 0, buf_offset);
+    xmemset(p + buf_offset + buf_len, 0, size - buf_offset - buf_len);
+  }
+
+  return p;
+}
+
 static int io_new_stream(char *tag, int fd, int line, int timeout, int timer, int end, io_addr_t *src, io_addr_t *addr, io_callback_f callback, io_custom_f custom, void *data, bt_provider_t *bt) {
   io_connection_t *con;
   int handle;
 
-  if ((con = xcalloc(1, sizeof(io_connection_t))) == NULL) {
+  if ((con = io_alloc(sizeof(io_connection_t), offsetof(io_connection_t, buffer), 2 * MAX_BUFFER)) == NULL) {
     return -1;
   }
 
@@ -378,7 +410,7 @@ static int io_stream_loop(io_server_t *server, int handle) {
   }
 
   if (r == 1 && buf) {
-    server->callback(IO_CMD, &server->addr, buf, n, -1, handle, &server->data);
+    io_callback(server->callback, IO_CMD, &server->addr, buf, n, -1, handle, &server->data);
     xfree(buf);
   }
 
@@ -399,9 +431,9 @@ static int io_stream_loop(io_server_t *server, int handle) {
     }
 
     if (server->fd != -1) {
-      server->callback(IO_BIND, &server->addr, NULL, 0, -1, handle, &server->data);
+      io_callback(server->callback, IO_BIND, &server->addr, NULL, 0, -1, handle, &server->data);
     } else {
-      if (server->callback(IO_BIND_ERROR, &server->addr, NULL, 0, -1, handle, &server->data)) {
+      if (io_callback(server->callback, IO_BIND_ERROR, &server->addr, NULL, 0, -1, handle, &server->data)) {
         return 1;
       }
       sys_usleep(500000);
@@ -452,7 +484,7 @@ static int io_stream_action(void *arg) {
     if (io_stream_loop(server, handle)) break;
   }
 
-  server->callback(IO_CLOSE, &server->addr, NULL, 0, -1, handle, &server->data);
+  io_callback(server->callback, IO_CLOSE, &server->addr, NULL, 0, -1, handle, &server->data);
 
   if (server->fd != -1) {
     sys_close(server->fd);
@@ -587,9 +619,9 @@ static int io_dgram_loop(io_server_t *server, int handle) {
         break;
     }
     if (server->fd != -1) {
-      server->callback(IO_BIND, &server->addr, NULL, 0, -1, handle, &server->data);
+      io_callback(server->callback, IO_BIND, &server->addr, NULL, 0, -1, handle, &server->data);
     } else {
-      if (server->callback(IO_BIND_ERROR, &server->addr, NULL, 0, -1, handle, &server->data)) {
+      if (io_callback(server->callback, IO_BIND_ERROR, &server->addr, NULL, 0, -1, handle, &server->data)) {
         return 1;
       }
       sys_usleep(500000);
@@ -625,7 +657,7 @@ debug_bytes(1, "XXX", &arg->buf, 20);
   }
 
   if (nread > 0) {
-    server->callback(IO_DATA, &addr, server->buffer, nread, -1, handle, &server->data);
+    io_callback(server->callback, IO_DATA, &addr, server->buffer, nread, -1, handle, &server->data);
   }
 
   return 0;
@@ -642,7 +674,7 @@ static int io_dgram_action(void *arg) {
     if (io_dgram_loop(server, handle)) break;
   }
 
-  server->callback(IO_CLOSE, &server->addr, NULL, 0, -1, handle, &server->data);
+  io_callback(server->callback, IO_CLOSE, &server->addr, NULL, 0, -1, handle, &server->data);
 
   if (server->fd != -1) {
     sys_close(server->fd);
@@ -668,7 +700,7 @@ int io_stream_server(char *tag, io_addr_t *addr, io_callback_f callback, io_cust
       return -1;
   }
 
-  if ((server = xcalloc(1, sizeof(io_server_t))) == NULL) {
+  if ((server = io_alloc(sizeof(io_server_t), offsetof(io_server_t, buffer), MAX_BUFFER)) == NULL) {
     return -1;
   }
 
@@ -770,7 +802,7 @@ int io_dgram_server(char *tag, io_addr_t *addr, io_callback_f callback, void *da
       return -1;
   }
 
-  if ((server = xcalloc(1, sizeof(io_server_t))) == NULL) {
+  if ((server = io_alloc(sizeof(io_server_t), offsetof(io_server_t, buffer), MAX_BUFFER)) == NULL) {
     return -1;
   }
 
@@ -831,10 +863,14 @@ int io_sendto_handle(char *tag, int handle, io_addr_t *addr, unsigned char *buf,
   arg->len = len;
   memcpy(&arg->buf, buf, len);
 
-  r = thread_client_write(handle, (unsigned char *)arg, n);
-  xfree(arg);
+  // on success the receiving thread owns arg
+  if ((r = thread_client_post(handle, arg, n, NULL)) <= 0) {
+    if (r == 0) debug(DEBUG_ERROR, "IO", "handle %d mailbox full, datagram of %u bytes dropped", handle, len);
+    xfree(arg);
+    return -1;
+  }
 
-  return r == -1 ? -1 : 0;
+  return 0;
 }
 
 int io_write_handle(char *tag, int handle, unsigned char *buf, unsigned int len) {
@@ -0,0 +1,464 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <errno.h>
+
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include "mailbox.h"
+#include "thread.h"
+#include "sys.h"
+#include "debug.h"
+#include "xalloc.h"
+
+// Lock-free multiple producer / single consumer queues used as thread
+// channels. The owner thread is only woken up through the eventfd when it is
+// blocked waiting, so writes and non blocking reads need no system call.
+// Slots are recycled, never freed; the handle carries a generation count.
+
+#define MAX_MAILBOXES 1024
+
+// default bound on the bytes queued on a mailbox
+#define MAILBOX_MAX_BYTES (32*1024*1024)
+
+#define MAILBOX_INDEX(h) ((h) & 0xFFFF)
+
+typedef struct mailbox_msg_t {
+  struct mailbox_msg_t *next;
+  void *buf;
+  unsigned int len;
+  int from;
+  void (*destructor)(void *buf);
+} mailbox_msg_t;
+
+typedef struct {
+  int handle;
+  int used;
+  int refs;
+  int waiting;
+  int fd;
+  uint32_t gen;
+  unsigned int count;
+  unsigned int bytes;
+  unsigned int limit;
+  mailbox_msg_t *head;
+  mailbox_msg_t *tail;
+  mailbox_msg_t stub;
+} mailbox_t;
+
+static mailbox_t slots[MAX_MAILBOXES];
+static unsigned int next_index;
+static int initialized;
+
+int mailbox_init(void) {
+#ifdef LINUX
+  int i;
+
+  for (i = 0; i < MAX_MAILBOXES; i++) {
+    xmemset(&slots[i], 0, sizeof(mailbox_t));
+    slots[i].fd = -1;
+  }
+  next_index = 1;
+  initialized = 1;
+
+  return 0;
+#else
+  debug(DEBUG_INFO, "MAILBOX", "mailboxes are not supported on this platform");
+  return -1;
+#endif
+}
+
+static void mailbox_push(mailbox_t *mb, mailbox_msg_t *msg) {
+  mailbox_msg_t *prev;
+
+  __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&mb->head, msg, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+// only the owner thread may pop
+static mailbox_msg_t *mailbox_pop(mailbox_t *mb) {
+  mailbox_msg_t *tail, *next, *head;
+
+  tail = mb->tail;
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &mb->stub) {
+    if (next == NULL) return NULL;
+    mb->tail = next;
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next) {
+    mb->tail = next;
+    return tail;
+  }
+
+  head = __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE);
+  if (tail != head) {
+    // a producer is in the middle of a push, the owner will be woken up
+    return NULL;
+  }
+
+  mailbox_push(mb, &mb->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (next) {
+    mb->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+static void mailbox_msg_free(mailbox_msg_t *msg) {
+  if (msg->buf) {
+    if (msg->destructor) {
+      msg->destructor(msg->buf);
+    } else {
+      xfree(msg->buf);
+    }
+  }
+  xfree(msg);
+}
+
+static void mailbox_drain(mailbox_t *mb) {
+  mailbox_msg_t *msg;
+
+  for (; (msg = mailbox_pop(mb)) != NULL;) {
+    mailbox_msg_free(msg);
+  }
+  mb->count = 0;
+  mb->bytes = 0;
+}
+
+int mailbox_close(void) {
+  int i;
+
+  if (initialized) {
+    for (i = 0; i < MAX_MAILBOXES; i++) {
+      if (slots[i].used) {
+        mailbox_drain(&slots[i]);
+      }
+      if (slots[i].fd != -1) {
+        sys_close(slots[i].fd);
+        slots[i].fd = -1;
+      }
+    }
+    initialized = 0;
+  }
+
+  return 0;
+}
+
+int mailbox_create(void) {
+  mailbox_t *mb;
+  unsigned int i, index;
+  int expected, handle = -1;
+
+  if (!initialized) return -1;
+
+  for (i = 0; i < MAX_MAILBOXES; i++) {
+    index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED) % MAX_MAILBOXES;
+    if (index == 0) continue;
+    mb = &slots[index];
+    expected = 0;
+    if (__atomic_compare_exchange_n(&mb->used, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+  }
+
+  if (i == MAX_MAILBOXES) {
+    debug(DEBUG_ERROR, "MAILBOX", "max mailboxes reached");
+    return -1;
+  }
+
+#ifdef LINUX
+  if (mb->fd == -1) {
+    if ((mb->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      debug_errno("MAILBOX", "eventfd");
+      __atomic_store_n(&mb->used, 0, __ATOMIC_RELEASE);
+      return -1;
+    }
+  }
+#endif
+
+  mb->gen = (mb->gen % 0x7FFF) + 1;
+  mb->waiting = 0;
+  mb->count = 0;
+  mb->bytes = 0;
+  mb->limit = MAILBOX_MAX_BYTES;
+  mb->stub.next = NULL;
+  mb->head = &mb->stub;
+  mb->tail = &mb->stub;
+  handle = (mb->gen << 16) | index;
+  __atomic_store_n(&mb->handle, handle, __ATOMIC_SEQ_CST);
+  debug(DEBUG_TRACE, "MAILBOX", "created mailbox %d (%d)", handle, index);
+
+  return handle;
+}
+
+// returns the slot for handle with its reference count incremented
+static mailbox_t *mailbox_get(int handle) {
+  mailbox_t *mb;
+  unsigned int index;
+
+  index = MAILBOX_INDEX(handle);
+  if (!MAILBOX_HANDLE(handle) || index == 0 || index >= MAX_MAILBOXES) {
+    return NULL;
+  }
+
+  mb = &slots[index];
+  __atomic_add_fetch(&mb->refs, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mb->handle, __ATOMIC_SEQ_CST) != handle) {
+    __atomic_sub_fetch(&mb->refs, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  return mb;
+}
+
+static void mailbox_put(mailbox_t *mb) {
+  __atomic_sub_fetch(&mb->refs, 1, __ATOMIC_RELEASE);
+}
+
+// only called by the owner thread
+static mailbox_t *mailbox_owner(int handle) {
+  unsigned int index;
+
+  index = MAILBOX_INDEX(handle);
+  if (!MAILBOX_HANDLE(handle) || index == 0 || index >= MAX_MAILBOXES) {
+    return NULL;
+  }
+
+  return slots[index].handle == handle ? &slots[index] : NULL;
+}
+
+int mailbox_destroy(int handle) {
+  mailbox_t *mb;
+
+  if ((mb = mailbox_owner(handle)) == NULL) {
+    debug(DEBUG_ERROR, "MAILBOX", "attempt to destroy invalid mailbox %d", handle);
+    return -1;
+  }
+
+  // new writers will fail from now on, wait for the ones already inside
+  __atomic_store_n(&mb->handle, 0, __ATOMIC_SEQ_CST);
+  for (; __atomic_load_n(&mb->refs, __ATOMIC_ACQUIRE) > 0;) {
+    sys_usleep(100);
+  }
+
+  mailbox_drain(mb);
+  debug(DEBUG_TRACE, "MAILBOX", "destroyed mailbox %d", handle);
+  __atomic_store_n(&mb->used, 0, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static void mailbox_wakeup(mailbox_t *mb) {
+#ifdef LINUX
+  uint64_t one = 1;
+
+  if (write(mb->fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+    debug_errno("MAILBOX", "write eventfd");
+  }
+#endif
+}
+
+// On success the mailbox owns buf, which is released with destructor, or
+// with xfree if destructor is NULL. Otherwise buf still belongs to the caller.
+// return -1: error
+// return  0: mailbox is full
+// return  len: message queued
+int mailbox_post(int handle, int from, void *buf, unsigned int len, void (*destructor)(void *buf)) {
+  mailbox_msg_t *msg;
+  mailbox_t *mb;
+  unsigned int bytes;
+
+  if ((mb = mailbox_get(handle)) == NULL) {
+    debug(DEBUG_ERROR, "MAILBOX", "write to invalid mailbox %d", handle);
+    return -1;
+  }
+
+  // a single message larger than the limit is still accepted on an empty mailbox
+  bytes = __atomic_add_fetch(&mb->bytes, len, __ATOMIC_RELAXED);
+  if (bytes > mb->limit && bytes > len) {
+    __atomic_sub_fetch(&mb->bytes, len, __ATOMIC_RELAXED);
+    mailbox_put(mb);
+    debug(DEBUG_TRACE, "MAILBOX", "mailbox %d is full (%u bytes)", handle, bytes - len);
+    return 0;
+  }
+
+  if ((msg = xmalloc(sizeof(mailbox_msg_t))) == NULL) {
+    __atomic_sub_fetch(&mb->bytes, len, __ATOMIC_RELAXED);
+    mailbox_put(mb);
+    return -1;
+  }
+
+  msg->buf = buf;
+  msg->len = len;
+  msg->from = from;
+  msg->destructor = destructor;
+
+  __atomic_add_fetch(&mb->count, 1, __ATOMIC_RELAXED);
+  mailbox_push(mb, msg);
+
+  // pairs with the fence in mailbox_receive
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mb->waiting, __ATOMIC_RELAXED)) {
+    mailbox_wakeup(mb);
+  }
+
+  mailbox_put(mb);
+
+  return len;
+}
+
+int mailbox_write(int handle, int from, unsigned char *buf, unsigned int len) {
+  unsigned char *copy = NULL;
+  int r;
+
+  if (len) {
+    if ((copy = xmalloc_raw(len)) == NULL) {
+      return -1;
+    }
+    xmemcpy(copy, buf, len);
+  }
+
+  if ((r = mailbox_post(handle, from, copy, len, NULL)) <= 0) {
+    if (r == 0) {
+      debug(DEBUG_ERROR, "MAILBOX", "mailbox %d is full, message dropped", handle);
+    }
+    if (copy) xfree(copy);
+  }
+
+  return r;
+}
+
+int mailbox_set_limit(int handle, unsigned int bytes) {
+  mailbox_t *mb;
+
+  if ((mb = mailbox_owner(handle)) == NULL) {
+    return -1;
+  }
+  mb->limit = bytes;
+
+  return 0;
+}
+
+// also returns early when the calling thread is asked to end
+static void mailbox_wait(mailbox_t *mb, uint32_t usec) {
+#ifdef LINUX
+  struct timeval tv;
+  fd_set rfds;
+  uint64_t value;
+  int endfd, finishfd, nfds, n;
+
+  endfd = thread_get_fd();
+  finishfd = thread_get_finish_fd();
+
+  FD_ZERO(&rfds);
+  FD_SET(mb->fd, &rfds);
+  nfds = mb->fd;
+  if (endfd != -1) {
+    FD_SET(endfd, &rfds);
+    if (endfd > nfds) nfds = endfd;
+  }
+  if (finishfd != -1) {
+    FD_SET(finishfd, &rfds);
+    if (finishfd > nfds) nfds = finishfd;
+  }
+  tv.tv_sec = usec / 1000000;
+  tv.tv_usec = usec % 1000000;
+
+  n = select(nfds + 1, &rfds, NULL, NULL, usec == ((uint32_t)-1) ? NULL : &tv);
+
+  if (n == -1 && errno != EINTR) {
+    debug_errno("MAILBOX", "select eventfd");
+  } else if (n > 0 && FD_ISSET(mb->fd, &rfds)) {
+    if (read(mb->fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+      debug_errno("MAILBOX", "read eventfd");
+    }
+  }
+#endif
+}
+
+// The caller owns *buf and must release it with *destructor, or with xfree
+// if *destructor is NULL.
+// return -1: error
+// return  0: no message within usec
+// return  1: message received
+int mailbox_receive(int handle, uint32_t usec, void **buf, unsigned int *len, void (**destructor)(void *buf), int *from) {
+  mailbox_msg_t *msg;
+  mailbox_t *mb;
+
+  *buf = NULL;
+  *len = 0;
+  *destructor = NULL;
+
+  if ((mb = mailbox_owner(handle)) == NULL) {
+    debug(DEBUG_ERROR, "MAILBOX", "read from invalid mailbox %d", handle);
+    return -1;
+  }
+
+  if ((msg = mailbox_pop(mb)) == NULL && usec) {
+    __atomic_store_n(&mb->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((msg = mailbox_pop(mb)) == NULL) {
+      mailbox_wait(mb, usec);
+      msg = mailbox_pop(mb);
+    }
+    __atomic_store_n(&mb->waiting, 0, __ATOMIC_RELAXED);
+  }
+
+  if (msg == NULL) {
+    return 0;
+  }
+
+  __atomic_sub_fetch(&mb->count, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&mb->bytes, msg->len, __ATOMIC_RELAXED);
+  *buf = msg->buf;
+  *len = msg->len;
+  *destructor = msg->destructor;
+  if (from) *from = msg->from;
+  xfree(msg);
+
+  return 1;
+}
+
+// may be called by any thread
+int mailbox_depth(int handle, unsigned int *count, unsigned int *bytes) {
+  mailbox_t *mb;
+
+  if ((mb = mailbox_get(handle)) == NULL) {
+    return -1;
+  }
+  *count = __atomic_load_n(&mb->count, __ATOMIC_RELAXED);
+  *bytes = __atomic_load_n(&mb->bytes, __ATOMIC_RELAXED);
+  mailbox_put(mb);
+
+  return 0;
+}
+
+int mailbox_peek(int handle) {
+  mailbox_t *mb;
+
+  if ((mb = mailbox_owner(handle)) == NULL) {
+    return -1;
+  }
+
+  return (mb->tail != &mb->stub || __atomic_load_n(&mb->stub.next, __ATOMIC_ACQUIRE) != NULL) ? 1 : 0;
+}
+
+int mailbox_fd(int handle) {
+  mailbox_t *mb;
+
+  return (mb = mailbox_owner(handle)) != NULL ? mb->fd : -1;
+}
@@ -0,0 +1,37 @@
+#ifndef PIT_MAILBOX_H
+#define PIT_MAILBOX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// mailbox handles are always above the UDP port range
+#define MAILBOX_HANDLE(h) ((h) > 0xFFFF)
+
+int mailbox_init(void);
+
+int mailbox_close(void);
+
+int mailbox_create(void);
+
+int mailbox_destroy(int handle);
+
+int mailbox_write(int handle, int from, unsigned char *buf, unsigned int len);
+
+int mailbox_post(int handle, int from, void *buf, unsigned int len, void (*destructor)(void *buf));
+
+int mailbox_receive(int handle, uint32_t usec, void **buf, unsigned int *len, void (**destructor)(void *buf), int *from);
+
+int mailbox_set_limit(int handle, unsigned int bytes);
+
+int mailbox_depth(int handle, unsigned int *count, unsigned int *bytes);
+
+int mailbox_peek(int handle);
+
+int mailbox_fd(int handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,6 +12,9 @@
 #include "pwindow.h"
 #include "thread.h"
 #include "ptr.h"
+#include "mutex.h"
+#include "trace.h"
+#include "sys.h"
 #include "debug.h"
 #include "xalloc.h"
 
@@ -21,6 +24,15 @@
 #define MAX_NEXT 8
 
 #define TAG_PLAY  "PLAY"
+#define TAG_STAGE "STAGE"
+#define TAG_BRANCH "BRANCH"
+
+#define NODE_LATENCY 256
+
+#define MAX_STAGES 16
+#define MAX_FANOUTS 8
+#define STAGE_WAIT 100000
+#define MAX_POOL   16
 
 typedef struct {
   char *tag;
@@ -36,16 +48,83 @@ typedef struct {
   audio_provider_t *ap;
   audio_t *a;
   int show;
+  int depth, policy;
+  unsigned int dropped;
+  void *stage;
+  int broadcast;
+  node_stats_t stats;
+  int64_t first_out, last_out;
+  int64_t latency[NODE_LATENCY];
+  uint32_t nlatency;
 } media_node_t;
 
+// Node statistics are only written by the thread processing the node, which
+// holds its lock, and are read without the lock (see node_stats).
+#define STAT_ADD(f, v) __atomic_store_n(&(f), (f) + (v), __ATOMIC_RELAXED)
+#define STAT_SET(f, v) __atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+#define STAT_GET(f)    __atomic_load_n(&(f), __ATOMIC_RELAXED)
+
+// A play runs its chain on its own thread, except for the nodes marked with
+// node_stage(). Each of those starts a stage that runs on another thread and
+// receives frames through a bounded queue, so stages work on different frames
+// at the same time. The frame buffer moves with the frame, it is not copied.
+// When the queue is full the stage policy decides whether the sender waits or
+// queued frames are dropped. The end of stream frame is never dropped.
+//
+// A node marked with node_broadcast() passes its frame to all of its next
+// nodes. Each branch after the first runs on a worker thread of the play,
+// and the node waits for all branches before it goes on. Branches share the
+// frame buffer; a branch that needs to change it gets its own copy first
+// (see media_frame_own).
+
+typedef struct {
+  media_frame_t frame;
+  int active;
+} media_item_t;
+
+typedef struct media_play_t media_play_t;
+
+typedef struct {
+  media_play_t *play;
+  char name[MAX_NAME];
+  int ptr, handle;
+  mutex_t *mutex;
+  cond_t *cond;
+  media_item_t *items;
+  int depth, policy, head, count;
+  unsigned int dropped;
+} media_stage_t;
+
+typedef struct media_fanout_t media_fanout_t;
+
 typedef struct {
+  media_fanout_t *fanout;
+  int ptr, handle;
+  media_frame_t frame;
+  int active, pending, r;
+} media_branch_t;
+
+struct media_fanout_t {
+  media_play_t *play;
+  int ptr, nbranches;
+  mutex_t *mutex;
+  cond_t *cond;
+  media_branch_t branches[MAX_NEXT];
+};
+
+struct media_play_t {
   int pe;
   script_ref_t ref;
   int ptr_node;
   int destroy;
   window_provider_t *wp;
   audio_provider_t *ap;
-} media_play_t;
+  mutex_t *mutex;
+  cond_t *cond;
+  media_stage_t *stages[MAX_STAGES];
+  media_fanout_t *fanouts[MAX_FANOUTS];
+  int nstages, nfanouts, running, pending, ended, error, stop;
+};
 
 static char *video_enc_names[] = { "unknown", "I420", "YUYV", "UYVY", "RGB", "RGBA", "RGB565", "GRAY", "MONO", "JPEG", "PNG", "OPAQUE", "BGRA" };
 
@@ -65,8 +144,155 @@ char *pcm_name(int pcm) {
   return pcm >= 1 && pcm <= PCM_LAST ? pcm_names[pcm] : pcm_names[0];
 }
 
+// wraps data in a buffer with one reference; without data, size bytes are allocated
+media_buffer_t *media_buffer_create(unsigned char *data, int size, void (*release)(unsigned char *data, void *arg), void *arg) {
+  media_buffer_t *b;
+
+  if ((b = xcalloc(1, sizeof(media_buffer_t))) != NULL) {
+    if (data == NULL && (data = xmalloc_raw(size)) == NULL) {
+      xfree(b);
+      return NULL;
+    }
+    b->ref = 1;
+    b->size = size;
+    b->data = data;
+    b->release = release;
+    b->arg = arg;
+  }
+
+  return b;
+}
+
+void media_buffer_release(media_buffer_t *b) {
+  if (__atomic_sub_fetch(&b->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (b->release) {
+      b->release(b->data, b->arg);
+    } else {
+      xfree(b->data);
+    }
+    xfree(b);
+  }
+}
+
+// ref counts the owner and the buffers handed out, the last one frees the pool
+struct media_pool_t {
+  mutex_t *mutex;
+  int ref, size, max, count, closed;
+  unsigned char *free[MAX_POOL];
+};
+
+static void media_pool_unref(media_pool_t *pool) {
+  int i, last;
+
+  if (mutex_lock(pool->mutex) == 0) {
+    last = --pool->ref == 0;
+    if (pool->closed) {
+      for (i = 0; i < pool->count; i++) {
+        xfree(pool->free[i]);
+      }
+      pool->count = 0;
+    }
+    mutex_unlock(pool->mutex);
+
+    if (last) {
+      mutex_destroy(pool->mutex);
+      xfree(pool);
+    }
+  }
+}
+
+static void media_pool_put(unsigned char *data, void *arg) {
+  media_pool_t *pool = (media_pool_t *)arg;
+
+  if (mutex_lock(pool->mutex) == 0) {
+    if (!pool->closed && pool->count < pool->max) {
+      pool->free[pool->count++] = data;
+      data = NULL;
+    }
+    mutex_unlock(pool->mutex);
+  }
+  if (data) xfree(data);
+  media_pool_unref(pool);
+}
+
+media_pool_t *media_pool_create(int size, int max) {
+  media_pool_t *pool;
+
+  if ((pool = xcalloc(1, sizeof(media_pool_t))) != NULL) {
+    if ((pool->mutex = mutex_create_fast("pool")) == NULL) {
+      xfree(pool);
+      return NULL;
+    }
+    pool->ref = 1;
+    pool->size = size;
+    pool->max = max < MAX_POOL ? max : MAX_POOL;
+  }
+
+  return pool;
+}
+
+// a buffer of the pool size, recycled or newly allocated
+media_buffer_t *media_pool_get(media_pool_t *pool) {
+  media_buffer_t *b;
+  unsigned char *data = NULL;
+
+  if (mutex_lock(pool->mutex) != 0) {
+    return NULL;
+  }
+  if (pool->count) data = pool->free[--pool->count];
+  pool->ref++;
+  mutex_unlock(pool->mutex);
+
+  if ((data == NULL && (data = xmalloc_raw(pool->size)) == NULL) ||
+      (b = media_buffer_create(data, pool->size, media_pool_put, pool)) == NULL) {
+    if (data) media_pool_put(data, pool);
+    else media_pool_unref(pool);
+    return NULL;
+  }
+
+  return b;
+}
+
+// buffers still held by frames are freed when they are released
+void media_pool_destroy(media_pool_t *pool) {
+  if (mutex_lock(pool->mutex) == 0) {
+    pool->closed = 1;
+    mutex_unlock(pool->mutex);
+  }
+  media_pool_unref(pool);
+}
+
+// the frame takes over the caller's reference to b
+int media_frame_attach(media_frame_t *f, media_buffer_t *b, int len) {
+  if (f->buffer) media_buffer_release(f->buffer);
+  f->buffer = b;
+  f->frame = b->data;
+  f->len = len;
+
+  return 0;
+}
+
+// dst becomes another reference to the buffer of src
+void media_frame_share(media_frame_t *dst, media_frame_t *src) {
+  *dst = *src;
+  if (dst->buffer) __atomic_add_fetch(&dst->buffer->ref, 1, __ATOMIC_RELAXED);
+}
+
+void media_frame_release(media_frame_t *f) {
+  if (f->buffer) media_buffer_release(f->buffer);
+  f->buffer = NULL;
+  f->frame = NULL;
+  f->len = 0;
+}
+
+// only an xmalloc'ed or pool buffer nobody else holds may be changed in place
+static int media_frame_writable(media_frame_t *f) {
+  return f->buffer && (f->buffer->release == NULL || f->buffer->release == media_pool_put) &&
+         __atomic_load_n(&f->buffer->ref, __ATOMIC_ACQUIRE) == 1;
+}
+
 int media_frame_put(media_frame_t *f, unsigned char *frame, int len) {
-  int r = -1;
+  media_buffer_t *b;
 
   switch (f->meta.type) {
     case FRAME_TYPE_AUDIO:
@@ -77,41 +303,51 @@ int media_frame_put(media_frame_t *f, unsigned char *frame, int len) {
       return -1;
   }
 
-  if (f->frame == NULL) {
-    if (len) {
-      if ((f->frame = xcalloc(1, len)) != NULL) {
-        f->alloc = len;
-        f->len = len;
-        xmemcpy(f->frame, frame, len);
-        r = 0;
-      } else {
-        f->alloc = 0;
-        f->len = 0;
-      }
-    } else {
-      f->alloc = 0;
-      f->len = 0;
-      r = 0;
-    }
+  if (len == 0) {
+    media_frame_release(f);
+    return 0;
+  }
 
-  } else if (f->alloc < len) {
-    if ((f->frame = xrealloc(f->frame, len)) != NULL) {
-      f->alloc = len;
-      f->len = len;
-      xmemcpy(f->frame, frame, len);
-      r = 0;
-    } else {
-      f->alloc = 0;
-      f->len = 0;
-    }
+  if (f->buffer && frame == f->frame && len <= f->buffer->size) {
+    f->len = len;
+    return 0;
+  }
 
-  } else {
+  if (media_frame_writable(f) && f->buffer->size >= len) {
+    xmemcpy(f->frame, frame, len);
     f->len = len;
-    if (frame && len) xmemcpy(f->frame, frame, len);
-    r = 0;
+    return 0;
   }
 
-  return r;
+  // frame may point into the old buffer, so it is released only after the copy
+  if ((b = media_buffer_create(NULL, len, NULL, NULL)) == NULL) {
+    media_frame_release(f);
+    return -1;
+  }
+  xmemcpy(b->data, frame, len);
+
+  return media_frame_attach(f, b, len);
+}
+
+// copies a shared or external buffer, before the frame is changed in place
+int media_frame_own(media_frame_t *f) {
+  media_buffer_t *b;
+
+  if (f->buffer == NULL || media_frame_writable(f)) {
+    return 0;
+  }
+
+  if (f->len == 0) {
+    media_frame_release(f);
+    return 0;
+  }
+
+  if ((b = media_buffer_create(NULL, f->len, NULL, NULL)) == NULL) {
+    return -1;
+  }
+  xmemcpy(b->data, f->frame, f->len);
+
+  return media_frame_attach(f, b, f->len);
 }
 
 static void node_destroy_callback(void *p) {
@@ -262,6 +498,48 @@ int node_option(int ptr, char *name, char *value) {
   return r;
 }
 
+int node_stage(int ptr, int depth, int policy) {
+  media_node_t *node;
+  int r = -1;
+
+  if ((node = (media_node_t *)ptr_lock(ptr, TAG_MEDIA_NODE)) != NULL) {
+    node->depth = depth > 0 ? depth : 0;
+    node->policy = policy;
+    r = 0;
+    ptr_unlock(ptr, TAG_MEDIA_NODE);
+  }
+
+  return r;
+}
+
+// frames dropped by the queue in front of the node, over all plays
+int node_dropped(int ptr, unsigned int *dropped) {
+  media_node_t *node;
+  int r = -1;
+
+  if ((node = (media_node_t *)ptr_lock(ptr, TAG_MEDIA_NODE)) != NULL) {
+    *dropped = node->dropped;
+    if (node->stage) *dropped += __atomic_load_n(&((media_stage_t *)node->stage)->dropped, __ATOMIC_RELAXED);
+    r = 0;
+    ptr_unlock(ptr, TAG_MEDIA_NODE);
+  }
+
+  return r;
+}
+
+int node_broadcast(int ptr, int broadcast) {
+  media_node_t *node;
+  int r = -1;
+
+  if ((node = (media_node_t *)ptr_lock(ptr, TAG_MEDIA_NODE)) != NULL) {
+    node->broadcast = broadcast;
+    r = 0;
+    ptr_unlock(ptr, TAG_MEDIA_NODE);
+  }
+
+  return r;
+}
+
 int node_call(int ptr, char *name, int (*callback)(void *data, void *arg), void *arg) {
   media_node_t *node;
   int r = -1;
@@ -278,34 +556,268 @@ int node_call(int ptr, char *name, int (*callback)(void *data, void *arg), void
   return r;
 }
 
-int64_t node_sync(int ptr) {
+static int latency_cmp(const void *a, const void *b) {
+  int64_t la = *(const int64_t *)a, lb = *(const int64_t *)b;
+  return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+int node_stats(int ptr, node_stats_t *stats) {
   media_node_t *node;
-  int64_t ts = 0;
+  int64_t first, last, latency[NODE_LATENCY];
+  uint64_t frames;
+  int i, n, r = -1;
+
+  // read without waiting for the node to finish processing a frame
+  if ((node = (media_node_t *)ptr_lock_shared(ptr, TAG_MEDIA_NODE)) != NULL) {
+    stats->frames_in = STAT_GET(node->stats.frames_in);
+    stats->frames_out = frames = STAT_GET(node->stats.frames_out);
+    stats->bytes_in = STAT_GET(node->stats.bytes_in);
+    stats->bytes_out = STAT_GET(node->stats.bytes_out);
+    stats->process_total = STAT_GET(node->stats.process_total);
+    stats->process_max = STAT_GET(node->stats.process_max);
+    for (i = 0; i < NODE_HIST; i++) {
+      stats->process_hist[i] = STAT_GET(node->stats.process_hist[i]);
+    }
+    stats->last_ts = __atomic_load_n(&node->ts, __ATOMIC_ACQUIRE);
+    first = STAT_GET(node->first_out);
+    last = STAT_GET(node->last_out);
+    stats->fps = frames > 1 && last > first ? (frames - 1) * 1000000.0 / (last - first) : 0;
+    n = STAT_GET(node->nlatency);
+    if (n > NODE_LATENCY) n = NODE_LATENCY;
+    for (i = 0; i < n; i++) {
+      latency[i] = STAT_GET(node->latency[i]);
+    }
+    ptr_unlock_shared(ptr, TAG_MEDIA_NODE);
+
+    if (n > 0) {
+      qsort(latency, n, sizeof(int64_t), latency_cmp);
+      stats->latency_p50 = latency[(n - 1) * 50 / 100];
+      stats->latency_p90 = latency[(n - 1) * 90 / 100];
+      stats->latency_p99 = latency[(n - 1) * 99 / 100];
+      stats->latency_max = latency[n - 1];
+    } else {
+      stats->latency_p50 = stats->latency_p90 = stats->latency_p99 = stats->latency_max = 0;
+    }
+    r = 0;
+  }
+
+  return r;
+}
+
+int node_stats_reset(int ptr) {
+  media_node_t *node;
+  int r = -1;
 
   if ((node = (media_node_t *)ptr_lock(ptr, TAG_MEDIA_NODE)) != NULL) {
-    ts = node->ts;
+    xmemset(&node->stats, 0, sizeof(node_stats_t));
+    node->first_out = 0;
+    node->last_out = 0;
+    node->nlatency = 0;
     ptr_unlock(ptr, TAG_MEDIA_NODE);
+    r = 0;
+  }
+
+  return r;
+}
+
+// reports how long the frame took from capture to this sink, and where
+static void media_latency(media_node_t *node, media_frame_t *frame, int64_t now) {
+  char buf[256];
+  int i, n;
+
+  trace_counter("latency", node->name, now - frame->capture);
+
+  if (debug_on(DEBUG_TRACE, "MEDIA")) {
+    buf[0] = 0;
+    for (i = 0, n = 0; i < frame->nstamps && n < (int)sizeof(buf) - 1; i++) {
+      // snprintf returns the length it wanted, which may not fit
+      n += snprintf(&buf[n], sizeof(buf) - n, " %lld", (long long)(frame->stamps[i] - frame->capture));
+      if (n > (int)sizeof(buf) - 1) n = (int)sizeof(buf) - 1;
+    }
+    debug(DEBUG_TRACE, "MEDIA", "node %s latency %lld us, arrivals%s", node->name, (long long)(now - frame->capture), buf);
+  }
+}
+
+static void node_account(media_node_t *node, int source, int in, media_frame_t *frame, int r, int64_t t0) {
+  int64_t now, t;
+  int i, out;
+
+  now = sys_get_clock();
+  t = now - t0;
+  out = frame->len;
+
+  // the frame a source gets is the one it produced last time
+  if (in > 0 && !source) {
+    STAT_ADD(node->stats.frames_in, 1);
+    STAT_ADD(node->stats.bytes_in, in);
+  }
+
+  if (r == 1 && out > 0) {
+    STAT_ADD(node->stats.frames_out, 1);
+    STAT_ADD(node->stats.bytes_out, out);
+    if (node->first_out == 0) STAT_SET(node->first_out, now);
+    STAT_SET(node->last_out, now);
+
+    if (frame->capture) {
+      STAT_SET(node->latency[node->nlatency % NODE_LATENCY], now - frame->capture);
+      STAT_SET(node->nlatency, node->nlatency + 1);
+      if (node->nnext == 0) {
+        media_latency(node, frame, now);
+      }
+    }
+  }
+
+  if ((in > 0 && !source) || out > 0) {
+    STAT_ADD(node->stats.process_total, t);
+    if (t > node->stats.process_max) STAT_SET(node->stats.process_max, t);
+    for (i = 0; t && i < NODE_HIST-1; i++) {
+      t >>= 1;
+    }
+    STAT_ADD(node->stats.process_hist[i], 1);
+  }
+}
+
+int64_t node_sync(int ptr) {
+  media_node_t *node;
+  int64_t ts = 0;
+
+  // read without waiting for the node to finish processing a frame
+  if ((node = (media_node_t *)ptr_lock_shared(ptr, TAG_MEDIA_NODE)) != NULL) {
+    ts = __atomic_load_n(&node->ts, __ATOMIC_ACQUIRE);
+    ptr_unlock_shared(ptr, TAG_MEDIA_NODE);
   }
 
   return ts;
 }
 
-// media_loop returns:
+static media_stage_t *media_stage_find(media_play_t *p, int ptr) {
+  int i;
+
+  for (i = 0; i < p->nstages; i++) {
+    if (p->stages[i]->ptr == ptr) return p->stages[i];
+  }
+
+  return NULL;
+}
+
+// drops up to n of the oldest queued frames, skipping the end of stream
+static int media_stage_drop(media_stage_t *stage, int n) {
+  media_item_t *item;
+  int i, j, dropped = 0;
+
+  for (i = 0, j = 0; i < stage->count; i++) {
+    item = &stage->items[(stage->head + i) % stage->depth];
+    if (dropped < n && item->active) {
+      media_frame_release(&item->frame);
+      dropped++;
+      continue;
+    }
+    if (j < i) stage->items[(stage->head + j) % stage->depth] = *item;
+    j++;
+  }
+
+  if (dropped) {
+    stage->count = j;
+    __atomic_add_fetch(&stage->dropped, dropped, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stage->play->pending, dropped, __ATOMIC_ACQ_REL);
+    trace_counter("drop", stage->name, stage->dropped);
+  }
+
+  return dropped;
+}
+
+// moves the frame and its buffer to the queue of the stage
+static int media_stage_push(media_stage_t *stage, media_frame_t *frame, int active) {
+  media_play_t *p = stage->play;
+  media_item_t *item;
+  int r = -1;
+
+  if (mutex_lock(stage->mutex) == 0) {
+    switch (stage->policy) {
+      case QUEUE_DROP:
+        if (stage->count == stage->depth) media_stage_drop(stage, 1);
+        break;
+      case QUEUE_LATEST:
+        media_stage_drop(stage, stage->count);
+        break;
+    }
+
+    // blocks also when only end of stream frames are queued
+    while (stage->count == stage->depth && !p->stop && !thread_must_end()) {
+      cond_timedwait(stage->cond, stage->mutex, STAGE_WAIT);
+    }
+
+    if (stage->count < stage->depth && !p->stop) {
+      item = &stage->items[(stage->head + stage->count) % stage->depth];
+      item->frame = *frame;
+      item->active = active;
+      stage->count++;
+      __atomic_add_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+      trace_counter("queue", stage->name, stage->count);
+      cond_broadcast(stage->cond);
+      frame->frame = NULL;
+      frame->buffer = NULL;
+      frame->len = 0;
+      r = 0;
+    }
+    mutex_unlock(stage->mutex);
+  }
+
+  return r;
+}
+
+static int media_stage_pop(media_stage_t *stage, media_frame_t *frame, int *active) {
+  media_play_t *p = stage->play;
+  media_item_t *item;
+  int r = -1;
+
+  if (mutex_lock(stage->mutex) == 0) {
+    if (stage->count == 0 && !p->stop) {
+      cond_timedwait(stage->cond, stage->mutex, STAGE_WAIT);
+    }
+
+    if (stage->count > 0) {
+      item = &stage->items[stage->head];
+      *frame = item->frame;
+      *active = item->active;
+      stage->head = (stage->head + 1) % stage->depth;
+      stage->count--;
+      trace_counter("queue", stage->name, stage->count);
+      cond_broadcast(stage->cond);
+      r = 1;
+    } else {
+      r = p->stop ? -1 : 0;
+    }
+    mutex_unlock(stage->mutex);
+  }
+
+  return r;
+}
+
+// media_run returns:
 // -1: error, abort action
 //  0: all nodes ended processing, abort action
-//  1: at least one node is still processing, continue action
+//  1: at least one node is still processing, or the frame was queued to a stage, continue action
+//  2: the frame was queued to a stage and no node so far is still processing
+
+static int media_fanout(media_play_t *p, int ptr, int *next, int n, media_frame_t *frame, int active, void *wp, void *ap);
 
-int media_loop(int ptr, media_frame_t *frame, void *_wp, void *_ap) {
+static int media_run(media_play_t *p, int ptr, media_frame_t *frame, int active, void *_wp, void *_ap) {
+  media_stage_t *stage;
   media_node_t *node;
   int ekey, mods, ebuttons;
-  int i, r, width, height, active, ptr_next;
+  int i, n, r, width, height, ptr_next, next[MAX_NEXT];
+  int source, len;
+  int64_t t0;
   window_provider_t *wp;
   audio_provider_t *ap;
 
-  active = 0;
   wp = (window_provider_t *)_wp;
   ap = (audio_provider_t *)_ap;
 
+  // no node has produced a frame yet in this pass, so this one is its source
+  source = active == 0;
+
   for (; !thread_must_end();) {
     if ((node = (media_node_t *)ptr_lock(ptr, TAG_MEDIA_NODE)) == NULL) {
       return -1;
@@ -319,14 +831,31 @@ int media_loop(int ptr, media_frame_t *frame, void *_wp, void *_ap) {
       debug(DEBUG_TRACE, "MEDIA", "processing node %d (%s)", ptr, node->name);
     }
 
+    trace_begin("media", node->name);
+    t0 = sys_get_clock();
+    len = frame->len;
+    if (source) {
+      frame->capture = 0;
+      frame->nstamps = 0;
+    }
+    if (frame->nstamps < MEDIA_STAMPS) {
+      frame->stamps[frame->nstamps++] = t0;
+    }
+
     if ((r = node->dispatch.process(frame, node->data)) < 0) {
       debug(DEBUG_ERROR, "MEDIA", "node %d (%s) process failed", ptr, node->name);
+      trace_end("media", node->name);
       ptr_unlock(ptr, TAG_MEDIA_NODE);
       return -1;
     }
 
+    // a source that does not know when its frame was captured started it now
+    if (source && frame->capture == 0) frame->capture = t0;
+    node_account(node, source, len, frame, r, t0);
+    source = 0;
+
     if (r == 1) {
-      node->ts = frame->ts;
+      __atomic_store_n(&node->ts, frame->ts, __ATOMIC_RELEASE);
       //debug(DEBUG_INFO, "MEDIA", "node %d (%s) %c ts %lld", ptr, node->name, frame->meta.type == FRAME_TYPE_VIDEO ? 'v' : 'a', node->ts);
       if (frame->meta.type == FRAME_TYPE_VIDEO) {
         if (node->show) {
@@ -368,6 +897,7 @@ int media_loop(int ptr, media_frame_t *frame, void *_wp, void *_ap) {
       }
     }
 
+    trace_end("media", node->name);
     active += r;
 
     if (frame->meta.type == FRAME_TYPE_VIDEO) {
@@ -378,6 +908,15 @@ int media_loop(int ptr, media_frame_t *frame, void *_wp, void *_ap) {
       debug(DEBUG_TRACE, "MEDIA", "processed  node %d (%s)", ptr, node->name);
     }
 
+    if (node->broadcast && node->nnext > 1) {
+      n = node->nnext;
+      for (i = 0; i < n; i++) {
+        next[i] = node->ptr_next[i];
+      }
+      ptr_unlock(ptr, TAG_MEDIA_NODE);
+      return media_fanout(p, ptr, next, n, frame, active, _wp, _ap);
+    }
+
     if (node->nnext > 1 && node->dispatch.next) {
       if ((i = node->dispatch.next(node->data)) < 0) {
         debug(DEBUG_ERROR, "MEDIA", "node %d (%s) next failed", ptr, node->name);
@@ -393,36 +932,433 @@ int media_loop(int ptr, media_frame_t *frame, void *_wp, void *_ap) {
  
     if (ptr_next == 0) break;
     ptr = ptr_next;
+
+    if (p && (stage = media_stage_find(p, ptr)) != NULL) {
+      if (media_stage_push(stage, frame, active) == -1) return -1;
+      return active ? 1 : 2;
+    }
   }
 
   return active ? 1 : 0;
 }
 
+int media_loop(int ptr, media_frame_t *frame, void *wp, void *ap) {
+  return media_run(NULL, ptr, frame, 0, wp, ap);
+}
+
+static int media_stage_action(void *arg) {
+  media_stage_t *stage;
+  media_play_t *p;
+  media_frame_t frame;
+  int active, r;
+
+  stage = (media_stage_t *)arg;
+  p = stage->play;
+  xmemset(&frame, 0, sizeof(media_frame_t));
+  debug(DEBUG_INFO, "MEDIA", "stage %s started", stage->name);
+
+  for (; !thread_must_end();) {
+    if ((r = media_stage_pop(stage, &frame, &active)) == -1) break;
+    if (r == 0) continue;
+
+    r = media_run(p, stage->ptr, &frame, active, p->wp, p->ap);
+    // an idle stage must not hold on to a capture buffer
+    media_frame_release(&frame);
+
+    // 0 at the end of a stage that ends the chain ends the play
+    mutex_lock(p->mutex);
+    if (r == -1) p->error = 1;
+    else if (r == 0) p->ended = 1;
+    __atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+    cond_broadcast(p->cond);
+    mutex_unlock(p->mutex);
+  }
+
+  media_frame_release(&frame);
+  debug(DEBUG_INFO, "MEDIA", "stage %s ended", stage->name);
+
+  mutex_lock(p->mutex);
+  p->running--;
+  cond_broadcast(p->cond);
+  mutex_unlock(p->mutex);
+
+  return 0;
+}
+
+// combines the results of the branches of a fanout
+static int media_branch_result(int r, int rb) {
+  if (r == -1 || rb == -1) return -1;
+  if (r == 1 || rb == 1) return 1;
+  if (r == 2 || rb == 2) return 2;
+  return 0;
+}
+
+// a branch that starts with a stage only queues the frame, so a slow stage
+// with a dropping queue does not hold back the other branches
+static int media_branch_enter(media_play_t *p, int ptr, media_frame_t *frame, int active, void *wp, void *ap) {
+  media_stage_t *stage;
+
+  if (p && (stage = media_stage_find(p, ptr)) != NULL) {
+    if (media_stage_push(stage, frame, active) == -1) return -1;
+    return active ? 1 : 2;
+  }
+
+  return media_run(p, ptr, frame, active, wp, ap);
+}
+
+static int media_branch_run(media_play_t *p, int ptr, media_frame_t *view, media_frame_t *frame, int active, void *wp, void *ap) {
+  int r;
+
+  media_frame_share(view, frame);
+  r = media_branch_enter(p, ptr, view, active, wp, ap);
+  media_frame_release(view);
+
+  return r;
+}
+
+static media_fanout_t *media_fanout_find(media_play_t *p, int ptr) {
+  int i;
+
+  for (i = 0; i < p->nfanouts; i++) {
+    if (p->fanouts[i]->ptr == ptr) return p->fanouts[i];
+  }
+
+  return NULL;
+}
+
+static int media_fanout(media_play_t *p, int ptr, int *next, int n, media_frame_t *frame, int active, void *wp, void *ap) {
+  media_fanout_t *fanout;
+  media_branch_t *b;
+  media_frame_t view;
+  int i, r;
+
+  fanout = p ? media_fanout_find(p, ptr) : NULL;
+
+  for (i = 1; fanout && i < n; i++) {
+    if (fanout->nbranches != n - 1 || fanout->branches[i-1].ptr != next[i]) fanout = NULL;
+  }
+
+  if (fanout == NULL) {
+    // not started with the play, or connected differently since
+    for (i = 0, r = 0; i < n; i++) {
+      r = media_branch_result(r, media_branch_run(p, next[i], &view, frame, active, wp, ap));
+    }
+    return r;
+  }
+
+  mutex_lock(fanout->mutex);
+  for (i = 0; i < fanout->nbranches; i++) {
+    b = &fanout->branches[i];
+    media_frame_share(&b->frame, frame);
+    b->active = active;
+    b->pending = 1;
+  }
+  cond_broadcast(fanout->cond);
+  mutex_unlock(fanout->mutex);
+
+  r = media_branch_run(p, next[0], &view, frame, active, wp, ap);
+
+  // the frame must not change until no branch is using it
+  mutex_lock(fanout->mutex);
+  for (i = 0; i < fanout->nbranches; i++) {
+    b = &fanout->branches[i];
+    while (b->pending) {
+      cond_timedwait(fanout->cond, fanout->mutex, STAGE_WAIT);
+    }
+    r = media_branch_result(r, b->r);
+  }
+  mutex_unlock(fanout->mutex);
+
+  return r;
+}
+
+static int media_branch_action(void *arg) {
+  media_branch_t *b;
+  media_fanout_t *fanout;
+  media_play_t *p;
+  int r;
+
+  b = (media_branch_t *)arg;
+  fanout = b->fanout;
+  p = fanout->play;
+
+  for (;;) {
+    mutex_lock(fanout->mutex);
+    if (!b->pending && !p->stop && !thread_must_end()) {
+      cond_timedwait(fanout->cond, fanout->mutex, STAGE_WAIT);
+    }
+    r = b->pending;
+    mutex_unlock(fanout->mutex);
+
+    if (r) {
+      r = media_branch_enter(p, b->ptr, &b->frame, b->active, p->wp, p->ap);
+      media_frame_release(&b->frame);
+
+      mutex_lock(fanout->mutex);
+      b->r = r;
+      b->pending = 0;
+      cond_broadcast(fanout->cond);
+      mutex_unlock(fanout->mutex);
+    } else if (p->stop || thread_must_end()) {
+      break;
+    }
+  }
+
+  mutex_lock(p->mutex);
+  p->running--;
+  cond_broadcast(p->cond);
+  mutex_unlock(p->mutex);
+
+  return 0;
+}
+
+static void media_fanout_destroy(media_fanout_t *fanout) {
+  if (fanout->cond) cond_destroy(fanout->cond);
+  if (fanout->mutex) mutex_destroy(fanout->mutex);
+  xfree(fanout);
+}
+
+static media_fanout_t *media_fanout_create(media_play_t *p, int ptr, media_node_t *node) {
+  media_fanout_t *fanout;
+  int i;
+
+  if ((fanout = xcalloc(1, sizeof(media_fanout_t))) != NULL) {
+    fanout->play = p;
+    fanout->ptr = ptr;
+    fanout->nbranches = node->nnext - 1;
+    for (i = 0; i < fanout->nbranches; i++) {
+      fanout->branches[i].fanout = fanout;
+      fanout->branches[i].ptr = node->ptr_next[i+1];
+    }
+    fanout->mutex = mutex_create_fast("fanout");
+    fanout->cond = cond_create("fanout");
+
+    if (fanout->mutex == NULL || fanout->cond == NULL) {
+      media_fanout_destroy(fanout);
+      fanout = NULL;
+    }
+  }
+
+  return fanout;
+}
+
+static void media_stage_destroy(media_stage_t *stage) {
+  media_node_t *node;
+  int i;
+
+  if ((node = (media_node_t *)ptr_lock(stage->ptr, TAG_MEDIA_NODE)) != NULL) {
+    node->dropped += stage->dropped;
+    if (node->stage == stage) node->stage = NULL;
+    ptr_unlock(stage->ptr, TAG_MEDIA_NODE);
+  }
+
+  for (i = 0; i < stage->count; i++) {
+    media_frame_release(&stage->items[(stage->head + i) % stage->depth].frame);
+  }
+  if (stage->items) xfree(stage->items);
+  if (stage->cond) cond_destroy(stage->cond);
+  if (stage->mutex) mutex_destroy(stage->mutex);
+  xfree(stage);
+}
+
+static media_stage_t *media_stage_create(media_play_t *p, int ptr, media_node_t *node) {
+  media_stage_t *stage;
+
+  if ((stage = xcalloc(1, sizeof(media_stage_t))) != NULL) {
+    stage->play = p;
+    stage->ptr = ptr;
+    stage->depth = node->depth;
+    stage->policy = node->policy;
+    strncpy(stage->name, node->name, MAX_NAME-1);
+    stage->mutex = mutex_create_fast("stage");
+    stage->cond = cond_create("stage");
+    stage->items = xcalloc(stage->depth, sizeof(media_item_t));
+
+    if (stage->mutex == NULL || stage->cond == NULL || stage->items == NULL) {
+      media_stage_destroy(stage);
+      stage = NULL;
+    }
+  }
+
+  return stage;
+}
+
+// creates the stages and fanouts of the marked nodes reachable from ptr
+static void media_graph_find(media_play_t *p, int ptr, int *visited, int *nvisited) {
+  media_node_t *node;
+  media_stage_t *stage;
+  media_fanout_t *fanout;
+  int i, n, next[MAX_NEXT];
+
+  for (i = 0; i < *nvisited; i++) {
+    if (visited[i] == ptr) return;
+  }
+  if (*nvisited == MAX_STAGES * MAX_NEXT) return;
+  visited[(*nvisited)++] = ptr;
+
+  if ((node = (media_node_t *)ptr_lock(ptr, TAG_MEDIA_NODE)) == NULL) {
+    return;
+  }
+
+  if (node->depth > 0 && ptr != p->ptr_node && p->nstages < MAX_STAGES) {
+    if ((stage = media_stage_create(p, ptr, node)) != NULL) {
+      p->stages[p->nstages++] = stage;
+      node->stage = stage;
+    }
+  }
+
+  if (node->broadcast && node->nnext > 1 && p->nfanouts < MAX_FANOUTS) {
+    if ((fanout = media_fanout_create(p, ptr, node)) != NULL) {
+      p->fanouts[p->nfanouts++] = fanout;
+    }
+  }
+
+  n = node->nnext;
+  for (i = 0; i < n; i++) {
+    next[i] = node->ptr_next[i];
+  }
+  ptr_unlock(ptr, TAG_MEDIA_NODE);
+
+  for (i = 0; i < n; i++) {
+    if (next[i] > 0) media_graph_find(p, next[i], visited, nvisited);
+  }
+}
+
+static int media_threads_start(media_play_t *p) {
+  int visited[MAX_STAGES * MAX_NEXT];
+  media_fanout_t *fanout;
+  int i, j, nvisited = 0;
+
+  media_graph_find(p, p->ptr_node, visited, &nvisited);
+  if (p->nstages == 0 && p->nfanouts == 0) return 0;
+
+  if ((p->mutex = mutex_create_fast("play")) == NULL || (p->cond = cond_create("play")) == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < p->nstages; i++) {
+    if ((p->stages[i]->handle = thread_begin(TAG_STAGE, media_stage_action, p->stages[i])) == -1) {
+      return -1;
+    }
+    mutex_lock(p->mutex);
+    p->running++;
+    mutex_unlock(p->mutex);
+  }
+
+  for (i = 0; i < p->nfanouts; i++) {
+    fanout = p->fanouts[i];
+    for (j = 0; j < fanout->nbranches; j++) {
+      if ((fanout->branches[j].handle = thread_begin(TAG_BRANCH, media_branch_action, &fanout->branches[j])) == -1) {
+        return -1;
+      }
+      mutex_lock(p->mutex);
+      p->running++;
+      mutex_unlock(p->mutex);
+    }
+  }
+
+  return 0;
+}
+
+// waits until the stages have processed all queued frames
+static void media_threads_wait(media_play_t *p) {
+  mutex_lock(p->mutex);
+  while (p->pending > 0 && !p->error && !thread_must_end()) {
+    cond_timedwait(p->cond, p->mutex, STAGE_WAIT);
+  }
+  mutex_unlock(p->mutex);
+}
+
+// lets the stages finish the queued frames, unless the play is aborting
+static void media_threads_stop(media_play_t *p, int drain) {
+  media_fanout_t *fanout;
+  int i, j;
+
+  if (p->nstages == 0 && p->nfanouts == 0) return;
+
+  if (p->mutex && p->cond) {
+    if (drain) media_threads_wait(p);
+    mutex_lock(p->mutex);
+    p->stop = 1;
+    mutex_unlock(p->mutex);
+
+    for (i = 0; i < p->nstages; i++) {
+      if (p->stages[i]->handle > 0) thread_end(TAG_STAGE, p->stages[i]->handle);
+      mutex_lock(p->stages[i]->mutex);
+      cond_broadcast(p->stages[i]->cond);
+      mutex_unlock(p->stages[i]->mutex);
+    }
+
+    for (i = 0; i < p->nfanouts; i++) {
+      fanout = p->fanouts[i];
+      for (j = 0; j < fanout->nbranches; j++) {
+        if (fanout->branches[j].handle > 0) thread_end(TAG_BRANCH, fanout->branches[j].handle);
+      }
+      mutex_lock(fanout->mutex);
+      cond_broadcast(fanout->cond);
+      mutex_unlock(fanout->mutex);
+    }
+
+    mutex_lock(p->mutex);
+    while (p->running > 0) {
+      cond_timedwait(p->cond, p->mutex, STAGE_WAIT);
+    }
+    mutex_unlock(p->mutex);
+  }
+
+  for (i = 0; i < p->nstages; i++) {
+    media_stage_destroy(p->stages[i]);
+  }
+  for (i = 0; i < p->nfanouts; i++) {
+    media_fanout_destroy(p->fanouts[i]);
+  }
+  p->nstages = 0;
+  p->nfanouts = 0;
+  if (p->cond) cond_destroy(p->cond);
+  if (p->mutex) mutex_destroy(p->mutex);
+}
+
 static int media_action(void *arg) {
   media_play_t *p;
   media_frame_t frame;
   script_arg_t ret;
   unsigned char *buf;
   unsigned int n;
-  int handle, r;
+  int handle, r, drain;
 
   p = (media_play_t *)arg;
   xmemset(&frame, 0, sizeof(media_frame_t));
   handle = thread_get_handle();
+  drain = 0;
 
-  for (; !thread_must_end();) {
-    if ((r = thread_server_read(&buf, &n)) == -1) break;
-    if (r == 1) {
-      if (buf) xfree(buf);
+  if (media_threads_start(p) == 0) {
+    for (; !thread_must_end();) {
+      if ((r = thread_server_read(&buf, &n)) == -1) break;
+      if (r == 1) {
+        if (buf) xfree(buf);
+      }
+      if ((r = media_run(p, p->ptr_node, &frame, 0, p->wp, p->ap)) <= 0) {
+        drain = r == 0;
+        break;
+      }
+      if (r == 2) {
+        // the chain may be ending, wait for the stages to tell
+        media_threads_wait(p);
+      }
+      if (__atomic_load_n(&p->error, __ATOMIC_ACQUIRE)) break;
+      if (__atomic_load_n(&p->ended, __ATOMIC_ACQUIRE)) {
+        drain = 1;
+        break;
+      }
     }
-    if (media_loop(p->ptr_node, &frame, p->wp, p->ap) <= 0) break;
   }
+  media_threads_stop(p, drain);
 
   if (p->ref) {
     script_call(p->pe, p->ref, &ret, "I", handle);
     script_remove_ref(p->pe, p->ref);
   }
-  if (frame.frame) xfree(frame.frame);
+  media_frame_release(&frame);
 
   if (p->destroy) {
     node_destroy_chain(p->ptr_node);
@@ -38,6 +38,26 @@ extern "C" {
 
 #define DEFAULT_JPEG_QUALITY 85
 
+// what a full stage queue does with a new frame
+#define QUEUE_BLOCK  0  // waits until the stage takes a frame
+#define QUEUE_DROP   1  // drops the oldest queued frame
+#define QUEUE_LATEST 2  // drops all queued frames, the stage only sees the newest
+
+// process() times use power of two buckets: bucket i counts times below 2^i us,
+// and the last bucket counts everything above
+#define NODE_HIST 24
+
+typedef struct {
+  uint64_t frames_in, frames_out;
+  uint64_t bytes_in, bytes_out;
+  uint64_t process_total, process_max;
+  uint32_t process_hist[NODE_HIST];
+  int64_t last_ts;
+  double fps;
+  // time from capture to the end of process() over the last frames, in us
+  uint64_t latency_p50, latency_p90, latency_p99, latency_max;
+} node_stats_t;
+
 typedef struct {
   int width, height, fwidth, fheight;
   int ar_num, ar_den, tb_num, tb_den;
@@ -58,11 +78,31 @@ typedef struct {
   } av;
 } media_meta_t;
 
+// Frame data lives in a reference counted buffer. Memory that does not come
+// from xmalloc (a capture buffer, for example) is given back through release.
+typedef struct {
+  int ref, size;
+  unsigned char *data;
+  void (*release)(unsigned char *data, void *arg);
+  void *arg;
+} media_buffer_t;
+
+// buffers of one size that are recycled when their last reference is released
+typedef struct media_pool_t media_pool_t;
+
+#define MEDIA_STAMPS 16
+
+// capture and stamps are sys_get_clock() times: when the frame was captured,
+// or its source started producing it, and when it arrived at each node
 typedef struct {
   media_meta_t meta;
   int64_t ts;
-  int alloc, len;
+  int64_t capture;
+  int64_t stamps[MEDIA_STAMPS];
+  int nstamps;
+  int len;
   unsigned char *frame;
+  media_buffer_t *buffer;
 } media_frame_t;
 
 typedef struct {
@@ -89,6 +129,16 @@ int node_disconnect(int ptr_source, int ptr_next);
 
 int node_show(int ptr, int show);
 
+int node_stage(int ptr, int depth, int policy);
+
+int node_dropped(int ptr, unsigned int *dropped);
+
+int node_stats(int ptr, node_stats_t *stats);
+
+int node_stats_reset(int ptr);
+
+int node_broadcast(int ptr, int broadcast);
+
 int node_call(int ptr, char *name, int (*callback)(void *data, void *arg), void *arg);
 
 int media_loop(int ptr, media_frame_t *frame, void *wp, void *ap);
@@ -101,6 +151,24 @@ int64_t node_sync(int ptr);
 
 int media_frame_put(media_frame_t *f, unsigned char *frame, int len);
 
+int media_frame_own(media_frame_t *f);
+
+media_buffer_t *media_buffer_create(unsigned char *data, int size, void (*release)(unsigned char *data, void *arg), void *arg);
+
+void media_buffer_release(media_buffer_t *b);
+
+media_pool_t *media_pool_create(int size, int max);
+
+media_buffer_t *media_pool_get(media_pool_t *pool);
+
+void media_pool_destroy(media_pool_t *pool);
+
+int media_frame_attach(media_frame_t *f, media_buffer_t *b, int len);
+
+void media_frame_share(media_frame_t *dst, media_frame_t *src);
+
+void media_frame_release(media_frame_t *f);
+
 char *video_encoding_name(int encoding);
 
 char *audio_encoding_name(int encoding);
@@ -11,15 +11,40 @@
 #include <errno.h>
 
 #include "mutex.h"
+#include "thread.h"
 #include "sys.h"
 #include "debug.h"
 #include "xalloc.h"
 
+#define MAX_PROF 256
+
+// number of trylock attempts before a fast mutex blocks
+#define MUTEX_SPIN 100
+
+// With PIT_NO_PROFILE lock timing, profiling and tracing are compiled out.
+// Otherwise they only run while profiling is enabled at runtime, and an
+// uncontended lock costs a trylock and an unlock.
+#ifdef PIT_NO_PROFILE
+#define MUTEX_PROFILING() 0
+#else
+#define MUTEX_PROFILING() __atomic_load_n(&profiling, __ATOMIC_RELAXED)
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define mutex_pause() __builtin_ia32_pause()
+#else
+#define mutex_pause()
+#endif
+
 struct mutex_t {
   pthread_mutex_t mutex;
   char name[16];
   int64_t t;
-  int count;
+  int count, spin;
+  mutex_stats_t *prof;
+  const char *file;
+  const char *func;
+  int line;
 };
 
 struct cond_t {
@@ -33,7 +58,153 @@ struct sema_t {
   int named;
 };
 
-mutex_t *mutex_create(char *name) {
+// Lock profiling aggregates all mutexes with the same name. Counters are
+// updated with atomics; the table itself and the worst sites are protected by
+// a plain pthread mutex, since a mutex_t here would profile itself.
+static mutex_stats_t prof[MAX_PROF];
+static int num_prof;
+static int profiling;
+static int ncpus;
+static pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static mutex_stats_t *mutex_prof_get(char *name) {
+  mutex_stats_t *p = NULL;
+  int i;
+
+  pthread_mutex_lock(&prof_mutex);
+  for (i = 0; i < num_prof; i++) {
+    if (!strcmp(prof[i].name, name)) {
+      p = &prof[i];
+      break;
+    }
+  }
+  if (p == NULL && num_prof < MAX_PROF) {
+    p = &prof[num_prof++];
+    strncpy(p->name, name, sizeof(p->name)-1);
+  }
+  pthread_mutex_unlock(&prof_mutex);
+
+  return p;
+}
+
+static int mutex_prof_bucket(uint64_t us) {
+  int i;
+
+  for (i = 0; us && i < MUTEX_HIST-1; i++) {
+    us >>= 1;
+  }
+
+  return i;
+}
+
+static void mutex_prof_site(mutex_site_t *worst, const char *file, const char *func, int line, uint64_t us) {
+  int i, j;
+
+  pthread_mutex_lock(&prof_mutex);
+  // a site keeps a single entry with its worst time
+  for (i = 0; i < MUTEX_WORST; i++) {
+    if (worst[i].file == file && worst[i].line == line) break;
+  }
+  if (i == MUTEX_WORST) {
+    for (i = 0, j = 1; j < MUTEX_WORST; j++) {
+      if (worst[j].us < worst[i].us) i = j;
+    }
+  }
+  if (us > worst[i].us) {
+    worst[i].file = file;
+    worst[i].func = func;
+    worst[i].line = line;
+    worst[i].us = us;
+  }
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+static void mutex_prof_time(uint64_t *total, uint64_t *max, uint32_t *hist, mutex_site_t *worst, const char *file, const char *func, int line, uint64_t us) {
+  uint64_t old;
+  int i;
+
+  __atomic_add_fetch(total, us, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist[mutex_prof_bucket(us)], 1, __ATOMIC_RELAXED);
+
+  for (old = __atomic_load_n(max, __ATOMIC_RELAXED); us > old;) {
+    if (__atomic_compare_exchange_n(max, &old, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+  }
+
+  // only take the lock when the time may enter the worst sites
+  for (i = 0; i < MUTEX_WORST; i++) {
+    if (us > __atomic_load_n(&worst[i].us, __ATOMIC_RELAXED)) {
+      mutex_prof_site(worst, file, func, line, us);
+      break;
+    }
+  }
+}
+
+static mutex_stats_t *mutex_prof(mutex_t *m) {
+  mutex_stats_t *p;
+
+  if ((p = __atomic_load_n(&m->prof, __ATOMIC_ACQUIRE)) == NULL) {
+    p = mutex_prof_get(m->name);
+    __atomic_store_n(&m->prof, p, __ATOMIC_RELEASE);
+  }
+
+  return p;
+}
+
+void mutex_profile(int enable) {
+#ifdef PIT_NO_PROFILE
+  debug(DEBUG_ERROR, "MUTEX", "lock profiling is not available");
+#else
+  __atomic_store_n(&profiling, enable ? 1 : 0, __ATOMIC_RELEASE);
+  debug(DEBUG_INFO, "MUTEX", "lock profiling %s", enable ? "enabled" : "disabled");
+#endif
+}
+
+int mutex_profiling(void) {
+  return MUTEX_PROFILING();
+}
+
+// returns a copy of the profile, sorted by total wait time
+mutex_stats_t *mutex_stats(int *n) {
+  mutex_stats_t *st, aux;
+  int i, j;
+
+  pthread_mutex_lock(&prof_mutex);
+  *n = num_prof;
+  if ((st = xcalloc(num_prof + 1, sizeof(mutex_stats_t))) != NULL) {
+    memcpy(st, prof, num_prof * sizeof(mutex_stats_t));
+  }
+  pthread_mutex_unlock(&prof_mutex);
+
+  if (st) {
+    for (i = 1; i < *n; i++) {
+      aux = st[i];
+      for (j = i; j > 0 && st[j-1].wait_total < aux.wait_total; j--) {
+        st[j] = st[j-1];
+      }
+      st[j] = aux;
+    }
+  } else {
+    *n = 0;
+  }
+
+  return st;
+}
+
+// keeps the lock names, so that cached entries stay valid
+void mutex_stats_reset(void) {
+  char name[16];
+  int i;
+
+  pthread_mutex_lock(&prof_mutex);
+  for (i = 0; i < num_prof; i++) {
+    memcpy(name, prof[i].name, sizeof(name));
+    memset(&prof[i], 0, sizeof(mutex_stats_t));
+    memcpy(prof[i].name, name, sizeof(name));
+  }
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+static mutex_t *mutex_create_type(char *name, int type) {
   mutex_t *m;
   pthread_mutexattr_t attr;
 
@@ -41,7 +212,7 @@ mutex_t *mutex_create(char *name) {
     strncpy(m->name, name, sizeof(m->name)-1);
 
     if (pthread_mutexattr_init(&attr) == 0) {
-      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+      pthread_mutexattr_settype(&attr, type);
 
       if (pthread_mutex_init(&m->mutex, &attr) != 0) {
         debug_errno("MUTEX", "pthread_mutex_init");
@@ -65,6 +236,38 @@ mutex_t *mutex_create(char *name) {
   return m;
 }
 
+mutex_t *mutex_create(char *name) {
+  return mutex_create_type(name, PTHREAD_MUTEX_RECURSIVE);
+}
+
+// A fast mutex is not recursive and spins for a while before blocking,
+// which pays off for locks held for short periods. Spinning is pointless
+// with a single CPU, since the holder cannot run while we spin.
+mutex_t *mutex_create_fast(char *name) {
+  mutex_t *m;
+
+  if (ncpus == 0) {
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  if ((m = mutex_create_type(name, PTHREAD_MUTEX_NORMAL)) != NULL) {
+    m->spin = ncpus > 1 ? MUTEX_SPIN : 0;
+  }
+
+  return m;
+}
+
+int mutex_set_name(mutex_t *m, char *name) {
+  if (m == NULL) return -1;
+
+  if (strncmp(m->name, name, sizeof(m->name)-1)) {
+    strncpy(m->name, name, sizeof(m->name)-1);
+    __atomic_store_n(&m->prof, NULL, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
 int mutex_destroy(mutex_t *m) {
   int r = -1;
 
@@ -80,20 +283,48 @@ int mutex_destroy(mutex_t *m) {
   return r;
 }
 
-int mutex_lock(mutex_t *m) {
-  int r = -1;
+int mutex_lock_full(const char *file, const char *func, int line, mutex_t *m) {
+  mutex_stats_t *p;
+  int64_t t;
+  int prof, i, r = -1;
 
   if (m) {
-    debug(DEBUG_TRACE, "MUTEX", "locking mutex %s (%08x)", m->name, m);
-    r = pthread_mutex_lock(&m->mutex);
+    p = NULL;
+    if ((prof = MUTEX_PROFILING()) != 0) {
+      debug(DEBUG_TRACE, "MUTEX", "locking mutex %s (%08x)", m->name, m);
+      p = mutex_prof(m);
+    }
+    if ((r = pthread_mutex_trylock(&m->mutex)) == EBUSY) {
+      for (i = 0; i < m->spin && r == EBUSY; i++) {
+        mutex_pause();
+        r = pthread_mutex_trylock(&m->mutex);
+      }
+      if (r == EBUSY) {
+        t = sys_get_clock();
+        r = pthread_mutex_lock(&m->mutex);
+        t = sys_get_clock() - t;
+        thread_mutex_wait(t);
+        if (p && r == 0) {
+          __atomic_add_fetch(&p->contended, 1, __ATOMIC_RELAXED);
+          mutex_prof_time(&p->wait_total, &p->wait_max, p->wait_hist, p->wait_worst, file, func, line, t);
+        }
+      }
+    }
     if (r != 0) {
       debug_errno("MUTEX", "pthread_mutex_lock");
     } else {
       if (m->count == 0) {
-        m->t = sys_get_clock();
+        // a zero start time means the hold time is not measured
+        m->t = prof ? sys_get_clock() : 0;
+        m->file = file;
+        m->func = func;
+        m->line = line;
       }
       m->count++;
-     debug(DEBUG_TRACE, "MUTEX", "locked mutex %s (%08x) count %d", m->name, m, m->count);
+      if (prof) {
+        if (p) __atomic_add_fetch(&p->locks, 1, __ATOMIC_RELAXED);
+        debug(DEBUG_TRACE, "MUTEX", "locked mutex %s (%08x) count %d", m->name, m, m->count);
+      }
     }
   }
 
@@ -101,22 +332,30 @@ int mutex_lock(mutex_t *m) {
 }
 
 int mutex_unlock(mutex_t *m) {
+  mutex_stats_t *p;
   int64_t dt;
-  int r = -1;
+  int prof, r = -1;
 
   if (m) {
-    debug(DEBUG_TRACE, "MUTEX", "unlocking mutex %s (%08x) count %d", m->name, m, m->count);
+    if ((prof = MUTEX_PROFILING()) != 0) {
+      debug(DEBUG_TRACE, "MUTEX", "unlocking mutex %s (%08x) count %d", m->name, m, m->count);
+    }
     m->count--;
-    if (m->count == 0) {
+    if (m->count == 0 && m->t) {
       dt = sys_get_clock() - m->t;
+      m->t = 0;
+      if (prof && (p = mutex_prof(m)) != NULL) {
+        mutex_prof_time(&p->hold_total, &p->hold_max, p->hold_hist, p->hold_worst, m->file, m->func, m->line, dt);
+      }
       if (dt >= 200000) {
         debug(DEBUG_INFO, "MUTEX", "mutex %s (%08x) locked for %lld us", m->name, m, dt);
       }
     }
     r = pthread_mutex_unlock(&m->mutex);
-    debug(DEBUG_TRACE, "MUTEX", "unlocked mutex %s (%08x)", m->name, m);
     if (r != 0) {
       debug_errno("MUTEX", "pthread_mutex_unlock");
+    } else if (prof) {
+      debug(DEBUG_TRACE, "MUTEX", "unlocked mutex %s (%08x)", m->name, m);
     }
   }
 
@@ -198,6 +437,7 @@ int cond_wait(cond_t *c, mutex_t *m) {
 
   if (c && m) {
     r = pthread_cond_wait(&c->cond, &m->mutex);
+    if (m->t) m->t = sys_get_clock();
     if (r != 0) {
       errno = r;
       debug_errno("MUTEX", "pthread_cond_wait \"%s\"", c->name);
@@ -214,13 +454,15 @@ int cond_timedwait(cond_t *c, mutex_t *m, int us) {
 
   if (c && m) {
     sys_get_clock_ts(&ts);
-    ts.tv_nsec += us*1000;
-    if (ts.tv_nsec > 1000000000) {
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
       ts.tv_sec++;
       ts.tv_nsec -= 1000000000;
     }
 
     r = pthread_cond_timedwait(&c->cond, &m->mutex, &ts);
+    if (m->t) m->t = sys_get_clock();
     if (r != 0) {
       if (r != ETIMEDOUT) {
         errno = r;
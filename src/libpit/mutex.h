@@ -9,14 +9,51 @@ typedef struct mutex_t mutex_t;
 typedef struct cond_t cond_t;
 typedef struct sema_t sema_t;
 
+// wait and hold histograms use power of two buckets: bucket i counts times
+// below 2^i us, and the last bucket counts everything above
+#define MUTEX_HIST  24
+#define MUTEX_WORST 4
+
+typedef struct {
+  const char *file;
+  const char *func;
+  int line;
+  uint64_t us;
+} mutex_site_t;
+
+typedef struct {
+  char name[16];
+  uint64_t locks, contended;
+  uint64_t wait_total, wait_max;
+  uint64_t hold_total, hold_max;
+  uint32_t wait_hist[MUTEX_HIST];
+  uint32_t hold_hist[MUTEX_HIST];
+  mutex_site_t wait_worst[MUTEX_WORST];
+  mutex_site_t hold_worst[MUTEX_WORST];
+} mutex_stats_t;
+
 mutex_t *mutex_create(char *name);
 
+mutex_t *mutex_create_fast(char *name);
+
+int mutex_set_name(mutex_t *m, char *name);
+
 int mutex_destroy(mutex_t *m);
 
-int mutex_lock(mutex_t *m);
+int mutex_lock_full(const char *file, const char *func, int line, mutex_t *m);
 
 int mutex_unlock(mutex_t *m);
 
+void mutex_profile(int enable);
+
+int mutex_profiling(void);
+
+mutex_stats_t *mutex_stats(int *n);
+
+void mutex_stats_reset(void);
+
+#define mutex_lock(m) mutex_lock_full(__FILE__, __FUNCTION__, __LINE__, m)
+
 cond_t *cond_create(char *name);
 
 int cond_destroy(cond_t *c);
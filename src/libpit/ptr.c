@@ -7,23 +7,58 @@
 #include <time.h>
 #include <sys/time.h>
 
+#include <pthread.h>
+
 #include "ptr.h"
 #include "mutex.h"
 #include "sys.h"
+#include "trace.h"
 #include "debug.h"
-
-#define MAX_PTRS 1024
-
-#define OP_LOCK   1
-#define OP_UNLOCK 2
-#define OP_WAIT   3
-#define OP_SIGNAL 4
-#define OP_FREE   5
+#include "xalloc.h"
+
+// The table grows in chunks of PTR_CHUNK slots up to MAX_PTRS slots. Chunks
+// are never released before ptr_close, so a slot address stays valid while
+// handles are checked without locks. Free slots are kept in per shard free
+// lists. Each thread is given its own shard round robin, and takes slots
+// from the other shards when its own is exhausted. The mutex and cond of
+// a slot are created on its first use and kept until ptr_close, so handle
+// churn does not allocate.
+#define PTR_CHUNK   1024
+#define MAX_CHUNKS  64
+#define MAX_PTRS    (PTR_CHUNK * MAX_CHUNKS)
+#define PTR_SHARDS  8
+
+// a handle is the slot index plus the slot generation
+#define PTR_INDEX_BITS 16
+#define PTR_INDEX(id)  ((id) & ((1 << PTR_INDEX_BITS) - 1))
+#define PTR_MAX_GEN    0x7FFF
+
+#define OP_LOCK     1
+#define OP_UNLOCK   2
+#define OP_WAIT     3
+#define OP_SIGNAL   4
+#define OP_FREE     5
+#define OP_SHARE    6
+#define OP_UNSHARE  7
+
+// Handles are validated without a global lock. An accessor first takes a
+// reference on the slot and then checks that the slot still holds its id.
+// A slot is only recycled after its id is cleared and all references are
+// gone. A lock holder keeps its reference until it unlocks, so a freed
+// handle is only destroyed when the last holder unlocks it.
+//
+// A shared lock only takes the reference and does not touch the handle
+// mutex, so it never waits for the exclusive holder. It guarantees that the
+// object is not destroyed while it is read, but not that it is unchanged:
+// fields read this way must be single words updated with atomic stores.
 
 typedef struct {
   unsigned int id;
-  int used, locking, delete;
-  int64_t t;
+  int used, c, refs, locking, sharing, delete;
+  int shard, next_free;
+  unsigned int gen;
+  char *tag;
+  char *alias;
   void (*destructor)(void *p);
   mutex_t *mutex;
   cond_t *cond;
@@ -34,102 +69,186 @@ typedef struct {
   char *tag;
 } generic_t;
 
-static ptr_t table[MAX_PTRS];
-static unsigned int next_id;
+typedef struct {
+  mutex_t *mutex;
+  int free;
+} ptr_shard_t;
+
+static ptr_t *chunks[MAX_CHUNKS];
+static int num_chunks;
+static ptr_shard_t shards[PTR_SHARDS];
+static int next_shard;
+static __thread int thread_shard __attribute__((tls_model("initial-exec"))) = -1;
 static mutex_t *mutex;
-static char *op_name[] = { "", "lock", "unlock", "wait", "signal", "free" };
+static char *op_name[] = { "", "lock", "unlock", "wait", "signal", "free", "share", "unshare" };
+
+static ptr_t *ptr_slot(int index) {
+  ptr_t *chunk;
+
+  if (index <= 0 || index >= MAX_PTRS) return NULL;
+  chunk = __atomic_load_n(&chunks[index / PTR_CHUNK], __ATOMIC_ACQUIRE);
+
+  return chunk ? &chunk[index % PTR_CHUNK] : NULL;
+}
 
 int ptr_init(void) {
+  char buf[16];
   int i;
 
-  if ((mutex = mutex_create("ptr")) == NULL) {
+  if ((mutex = mutex_create_fast("ptr")) == NULL) {
     return -1;
   }
 
-  for (i = 0; i < MAX_PTRS; i++) {
-    table[i].id = 0;
-    table[i].used = 0;
-    table[i].locking = 0;
-    table[i].delete = 0;
-    table[i].destructor = NULL;
-    table[i].mutex = NULL;
-    table[i].p = NULL;
+  for (i = 0; i < MAX_CHUNKS; i++) {
+    chunks[i] = NULL;
   }
+  num_chunks = 0;
 
-  table[0].used = 1;
-  next_id = 1;
+  for (i = 0; i < PTR_SHARDS; i++) {
+    snprintf(buf, sizeof(buf)-1, "ptr_shard%d", i);
+    shards[i].mutex = mutex_create_fast(buf);
+    shards[i].free = 0;
+  }
 
   return 0;
 }
 
 int ptr_close(void) {
-  //generic_t *gp;
-  int i;
-
-  for (i = 1; i < MAX_PTRS; i++) {
-/*
-    gp = (generic_t *)table[i].p;
-    if (table[i].used) {
-      debug(DEBUG_INFO, "PTR", "handle %d (%d) (%s) was not closed", table[i].id, i, gp->tag);
+  ptr_t *ptr;
+  int i, j;
+
+  for (i = 0; i < num_chunks; i++) {
+    for (j = 0; j < PTR_CHUNK; j++) {
+      ptr = &chunks[i][j];
+      if (ptr->mutex) mutex_destroy(ptr->mutex);
+      if (ptr->cond) cond_destroy(ptr->cond);
     }
-*/
-    table[i].used = 0;
-    table[i].locking = 0;
-    table[i].delete = 0;
-    table[i].destructor = NULL;
-    if (table[i].mutex) mutex_destroy(table[i].mutex);
-    if (table[i].cond) cond_destroy(table[i].cond);
-    table[i].mutex = NULL;
-    table[i].cond = NULL;
-    table[i].p = NULL;
+    xfree(chunks[i]);
+    chunks[i] = NULL;
   }
+  num_chunks = 0;
 
+  for (i = 0; i < PTR_SHARDS; i++) {
+    mutex_destroy(shards[i].mutex);
+    shards[i].mutex = NULL;
+  }
   mutex_destroy(mutex);
 
   return 0;
 }
 
+// adds a new chunk and gives its slots to shard, called with the shard locked
+static int ptr_grow(int shard) {
+  ptr_t *chunk;
+  int i, base, first;
+
+  if (mutex_lock(mutex) != 0) {
+    return -1;
+  }
+
+  if (num_chunks == MAX_CHUNKS || (chunk = xcalloc(PTR_CHUNK, sizeof(ptr_t))) == NULL) {
+    mutex_unlock(mutex);
+    return -1;
+  }
+
+  base = num_chunks * PTR_CHUNK;
+  // slot 0 is never used, so that no handle is 0
+  first = base ? 0 : 1;
+  for (i = first; i < PTR_CHUNK; i++) {
+    chunk[i].shard = shard;
+    chunk[i].next_free = (i < PTR_CHUNK-1) ? base + i + 1 : shards[shard].free;
+  }
+  shards[shard].free = base + first;
+
+  __atomic_store_n(&chunks[num_chunks], chunk, __ATOMIC_RELEASE);
+  num_chunks++;
+  debug(DEBUG_INFO, "PTR", "table grown to %d slots", num_chunks * PTR_CHUNK);
+  mutex_unlock(mutex);
+
+  return 0;
+}
+
+static void ptr_put_free(ptr_t *ptr, int index) {
+  ptr_shard_t *shard;
+
+  shard = &shards[ptr->shard];
+  if (mutex_lock(shard->mutex) == 0) {
+    ptr->next_free = shard->free;
+    shard->free = index;
+    mutex_unlock(shard->mutex);
+  }
+}
+
+// takes a free slot from shard i, growing the table only if grow is set
+static int ptr_get_free(int i, int grow) {
+  ptr_shard_t *shard;
+  ptr_t *ptr;
+  int index = 0;
+
+  shard = &shards[i];
+  if (mutex_lock(shard->mutex) == 0) {
+    if (shard->free || (grow && ptr_grow(i) == 0)) {
+      index = shard->free;
+      ptr = ptr_slot(index);
+      shard->free = ptr->next_free;
+    }
+    mutex_unlock(shard->mutex);
+  }
+
+  return index;
+}
+
 static int ptr_new_aux(void *p, void (*destructor)(void *p), int c) {
   generic_t *gp;
+  ptr_t *ptr;
   char buf[16];
-  int id, i, index;
+  int id, index, i, j;
 
   id = -1;
+  if ((i = thread_shard) == -1) {
+    i = thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % PTR_SHARDS;
+  }
 
-  if (mutex_lock(mutex) == 0) {
-    for (i = 0; i < MAX_PTRS; i++) {
-      id = next_id + i;
-      index = id % MAX_PTRS;
-
-      if (!table[index].used) {
-        snprintf(buf, sizeof(buf)-1, "ptr%d", id);
-        table[index].mutex = mutex_create(buf);
-
-        if (table[index].mutex == NULL) {
-          id = -1;
-        } else {
-          table[index].id = id;
-          table[index].used = 1;
-          table[index].locking = 0;
-          table[index].delete = 0;
-          table[index].destructor = destructor;
-          table[index].p = p;
-          if (c) table[index].cond = cond_create(buf);
-          gp = (generic_t *)table[index].p;
-          debug(DEBUG_TRACE, "PTR", "new handle %d (%d) (%s) (%08x)", id, index, gp->tag, p);
-        }
-        break;
-      }
+  if ((index = ptr_get_free(i, 1)) == 0) {
+    // the table is full, take a slot freed on another shard
+    for (j = 1; j < PTR_SHARDS && index == 0; j++) {
+      index = ptr_get_free((i + j) % PTR_SHARDS, 0);
     }
-
-    if (i == MAX_PTRS) {
+    if (index == 0) {
       debug(DEBUG_ERROR, "PTR", "max pointers reached");
-      id = -1;
-    } else {
-      next_id = id + 1;
+      return -1;
     }
+  }
 
-    mutex_unlock(mutex);
+  ptr = ptr_slot(index);
+
+  // the mutex and cond belong to the slot and are reused by its next handles
+  if (ptr->mutex == NULL || (c && ptr->cond == NULL)) {
+    snprintf(buf, sizeof(buf)-1, "ptr%d", index);
+    if (ptr->mutex == NULL) ptr->mutex = mutex_create(buf);
+    if (c && ptr->cond == NULL) ptr->cond = cond_create(buf);
+  }
+
+  if (ptr->mutex == NULL || (c && ptr->cond == NULL)) {
+    ptr_put_free(ptr, index);
+  } else {
+    ptr->gen = (ptr->gen % PTR_MAX_GEN) + 1;
+    id = (ptr->gen << PTR_INDEX_BITS) | index;
+    gp = (generic_t *)p;
+    // handle locks are profiled by tag
+    mutex_set_name(ptr->mutex, gp->tag);
+    ptr->used = 1;
+    ptr->c = c;
+    ptr->locking = 0;
+    ptr->sharing = 0;
+    ptr->delete = 0;
+    ptr->tag = gp->tag;
+    ptr->alias = NULL;
+    ptr->destructor = destructor;
+    ptr->p = p;
+    // publishing the id makes the handle visible to ptr_access
+    __atomic_store_n(&ptr->id, id, __ATOMIC_RELEASE);
+    debug(DEBUG_TRACE, "PTR", "new handle %d (%d) (%s) (%08x)", id, index, gp->tag, p);
   }
 
   return id;
@@ -143,136 +262,176 @@ int ptr_new_c(void *p, void (*destructor)(void *p)) {
   return ptr_new_aux(p, destructor, 1);
 }
 
-static void *ptr_access(const char *file, const char *func, int line, int id, char *tag, int op, uint32_t arg) {
-  int index, delete, locking, ok;
+// Tags are compared by pointer. The same tag string may live at different
+// addresses in different libraries, so the last pointer that matched with
+// strcmp is remembered as an alias of the slot tag.
+static int ptr_tag_match(ptr_t *ptr, char *tag) {
+  if (tag == ptr->tag || tag == __atomic_load_n(&ptr->alias, __ATOMIC_RELAXED)) {
+    return 1;
+  }
+
+  if (tag && !strcmp(ptr->tag, tag)) {
+    __atomic_store_n(&ptr->alias, tag, __ATOMIC_RELAXED);
+    return 1;
+  }
+
+  return 0;
+}
+
+// drops a reference and destroys the slot if it was the last one of a freed handle
+static void ptr_release(ptr_t *ptr, int id, int index, char *tag) {
   void (*destructor)(void *p);
-  mutex_t *ptr_mutex;
-  cond_t *ptr_cond;
+  int expected;
+  void *p;
+
+  if (__atomic_sub_fetch(&ptr->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  expected = 1;
+  if (!__atomic_compare_exchange_n(&ptr->delete, &expected, 2, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  // new accessors fail from now on, wait for the ones that are still checking
+  __atomic_store_n(&ptr->id, 0, __ATOMIC_SEQ_CST);
+  for (; __atomic_load_n(&ptr->refs, __ATOMIC_ACQUIRE) > 0;) {
+    sys_usleep(10);
+  }
+
+  debug(DEBUG_TRACE, "PTR", "free handle %d (%d) (%s)", id, index, tag);
+  p = ptr->p;
+  destructor = ptr->destructor;
+  ptr->destructor = NULL;
+  ptr->p = NULL;
+  ptr->locking = 0;
+  ptr->sharing = 0;
+  ptr->delete = 0;
+  ptr->used = 0;
+  ptr_put_free(ptr, index);
+
+  if (destructor) destructor(p);
+}
+
+static void *ptr_access(const char *file, const char *func, int line, int id, char *tag, int op, uint32_t arg) {
+  int index, locking, prof, ok, cur;
+  ptr_t *ptr;
   generic_t *p;
-  int64_t t;
+  int64_t t0, t;
 
-  index = id % MAX_PTRS;
-  destructor = NULL;
-  ptr_mutex = NULL;
+  index = PTR_INDEX(id);
   p = NULL;
   ok = 0;
 
-  if (mutex_lock(mutex) == 0) {
-    if (index > 0 && index < MAX_PTRS) {
-      if (table[index].used) {
-        if (!table[index].delete) {
-          if (table[index].id == id) {
-            p = (generic_t *)table[index].p;
-
-            if (!strcmp(p->tag, tag)) {
-              switch (op) {
-                case OP_LOCK:
-                  table[index].locking++;
-                  ok = 1;
-                  break;
-                case OP_UNLOCK:
-                  if (table[index].locking) {
-                    table[index].locking--;
-                    ok = 1;
-                  }
-                  break;
-                case OP_WAIT:
-                  if (table[index].locking) {
-                    ok = 1;
-                  }
-                  break;
-                case OP_SIGNAL:
-                  if (table[index].locking) {
-                    ok = 1;
-                  }
-                  break;
-                case OP_FREE:
-                  table[index].delete = 1;
-                  ok = 1;
-                  break;
-              }
-
-              delete = table[index].delete;
-              locking = table[index].locking;
-              ptr_mutex = table[index].mutex;
-              ptr_cond = table[index].cond;
-              destructor = table[index].destructor;
-
-            } else {
-              debug(DEBUG_ERROR, "PTR", "attempt to %s handle %d with tag %s != %s", op_name[op], id, p->tag, tag);
-            }
-          } else {
-            debug(DEBUG_ERROR, "PTR", "attempt to %s wrong handle %d != %d (%d)", op_name[op], id, table[index].id, index);
-          }
-        } else {
-          debug(DEBUG_ERROR, "PTR", "attempt to %s deleted handle %d (%d)", op_name[op], id, index);
-        }
-      } else {
-        debug(DEBUG_ERROR, "PTR", "attempt to %s unused handle %d (%d)", op_name[op], id, index);
-      }
+  if (id <= 0 || (ptr = ptr_slot(index)) == NULL) {
+    debug(DEBUG_ERROR, "PTR", "attempt to %s invalid handle %d (%d)", op_name[op], id, index);
+    return NULL;
+  }
+
+  __atomic_add_fetch(&ptr->refs, 1, __ATOMIC_SEQ_CST);
+
+  if ((cur = __atomic_load_n(&ptr->id, __ATOMIC_SEQ_CST)) != id) {
+    if (cur == 0) {
+      debug(DEBUG_ERROR, "PTR", "attempt to %s unused handle %d (%d)", op_name[op], id, index);
     } else {
-      debug(DEBUG_ERROR, "PTR", "attempt to %s invalid handle %d (%d)", op_name[op], id, index);
+      debug(DEBUG_ERROR, "PTR", "attempt to %s wrong handle %d != %d (%d)", op_name[op], id, cur, index);
     }
-    mutex_unlock(mutex);
+    // the last reference to a freed handle may be this one
+    ptr_release(ptr, cur, index, ptr->tag);
+    return NULL;
   }
 
-  if (ok) {
-    switch (op) {
-      case OP_LOCK:
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "locking handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-        t = sys_get_clock();
-        if (mutex_lock(ptr_mutex) != 0) {
-          p = NULL;
-        } else {
-          debug_full(file, func, line, DEBUG_TRACE, "PTR", "locked handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-          t = sys_get_clock() - t;
-          if (t >= 5000) {
-            debug_full(file, func, line, DEBUG_INFO, "PTR", "lock handle %d (%d) (%s) wait %lld us", id, index, tag, t);
-          }
-        }
-        break;
-      case OP_UNLOCK:
-        mutex_unlock(ptr_mutex);
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "unlocked handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-        break;
-      case OP_WAIT:
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "waiting handle %d (%d) (%s) locking=%d us=%d", id, index, tag, locking, arg);
-        if (cond_timedwait(ptr_cond, ptr_mutex, arg) != 0) {
-          p = NULL;
-        } else {
-          debug_full(file, func, line, DEBUG_TRACE, "PTR", "waited handle %d (%d) (%s) locking=%d us=%d", id, index, tag, locking, arg);
+  // a freed handle can still be unlocked by its lock holders
+  if (__atomic_load_n(&ptr->delete, __ATOMIC_ACQUIRE) && op != OP_UNLOCK && op != OP_UNSHARE) {
+    debug(DEBUG_ERROR, "PTR", "attempt to %s deleted handle %d (%d)", op_name[op], id, index);
+    ptr_release(ptr, id, index, tag);
+    return NULL;
+  }
+
+  p = (generic_t *)ptr->p;
+
+  if (!ptr_tag_match(ptr, tag)) {
+    debug(DEBUG_ERROR, "PTR", "attempt to %s handle %d with tag %s != %s", op_name[op], id, p->tag, tag);
+    ptr_release(ptr, id, index, tag);
+    return NULL;
+  }
+
+  switch (op) {
+    case OP_LOCK:
+      locking = __atomic_add_fetch(&ptr->locking, 1, __ATOMIC_ACQ_REL);
+      debug_at(file, func, line, DEBUG_TRACE, "PTR", "locking handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+      prof = mutex_profiling();
+      // only a contended lock can wait long enough to be traced
+      t0 = prof || (trace_active && locking > 1) ? sys_get_clock() : 0;
+      if (mutex_lock_full(file, func, line, ptr->mutex) != 0) {
+        __atomic_sub_fetch(&ptr->locking, 1, __ATOMIC_ACQ_REL);
+        p = NULL;
+      } else {
+        debug_at(file, func, line, DEBUG_TRACE, "PTR", "locked handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+        t = t0 ? sys_get_clock() - t0 : 0;
+        if (prof && t >= 5000) {
+          debug_at(file, func, line, DEBUG_INFO, "PTR", "lock handle %d (%d) (%s) wait %lld us", id, index, tag, t);
         }
-        break;
-      case OP_SIGNAL:
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "signaling handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-        if (cond_signal(ptr_cond) != 0) {
-          p = NULL;
-        } else {
-          debug_full(file, func, line, DEBUG_TRACE, "PTR", "signaled handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+        if (t >= TRACE_LOCK_WAIT) {
+          trace_span("lock", tag, t0, t);
         }
-        break;
-    }
-
-    if (delete && locking == 0) {
-      if (mutex_lock(mutex) == 0) {
-        debug(DEBUG_TRACE, "PTR", "free handle %d (%d) (%s)", id, index, tag);
-        table[index].used = 0;
-        table[index].locking = 0;
-        table[index].delete = 0;
-        table[index].destructor = NULL;
-        if (table[index].mutex) mutex_destroy(table[index].mutex);
-        if (table[index].cond) cond_destroy(table[index].cond);
-        table[index].mutex = NULL;
-        table[index].cond = NULL;
-        table[index].p = NULL;
-        mutex_unlock(mutex);
-        if (destructor) destructor(p);
+        // the reference is kept until the handle is unlocked
+        ok = 1;
+      }
+      break;
+    case OP_UNLOCK:
+      locking = __atomic_load_n(&ptr->locking, __ATOMIC_ACQUIRE);
+      if (locking > 0) {
+        locking = __atomic_sub_fetch(&ptr->locking, 1, __ATOMIC_ACQ_REL);
+        mutex_unlock(ptr->mutex);
+        debug_at(file, func, line, DEBUG_TRACE, "PTR", "unlocked handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+        // drop the reference taken by the lock
+        ptr_release(ptr, id, index, tag);
       } else {
-        debug(DEBUG_ERROR, "PTR", "free handle %d (%d) (%s), lock failed", id, index, tag);
+        p = NULL;
       }
-    }
-  } else {
-    p = NULL;
+      break;
+    case OP_WAIT:
+      locking = __atomic_load_n(&ptr->locking, __ATOMIC_ACQUIRE);
+      debug_at(file, func, line, DEBUG_TRACE, "PTR", "waiting handle %d (%d) (%s) locking=%d us=%d", id, index, tag, locking, arg);
+      if (locking == 0 || !ptr->c || cond_timedwait(ptr->cond, ptr->mutex, arg) != 0) {
+        p = NULL;
+      } else {
+        debug_at(file, func, line, DEBUG_TRACE, "PTR", "waited handle %d (%d) (%s) locking=%d us=%d", id, index, tag, locking, arg);
+      }
+      break;
+    case OP_SIGNAL:
+      locking = __atomic_load_n(&ptr->locking, __ATOMIC_ACQUIRE);
+      debug_at(file, func, line, DEBUG_TRACE, "PTR", "signaling handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+      if (locking == 0 || !ptr->c || cond_signal(ptr->cond) != 0) {
+        p = NULL;
+      } else {
+        debug_at(file, func, line, DEBUG_TRACE, "PTR", "signaled handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+      }
+      break;
+    case OP_FREE:
+      __atomic_store_n(&ptr->delete, 1, __ATOMIC_RELEASE);
+      break;
+    case OP_SHARE:
+      __atomic_add_fetch(&ptr->sharing, 1, __ATOMIC_ACQ_REL);
+      debug_at(file, func, line, DEBUG_TRACE, "PTR", "shared handle %d (%d) (%s)", id, index, tag);
+      // the reference is kept until the handle is unshared
+      ok = 1;
+      break;
+    case OP_UNSHARE:
+      if (__atomic_sub_fetch(&ptr->sharing, 1, __ATOMIC_ACQ_REL) >= 0) {
+        debug_at(file, func, line, DEBUG_TRACE, "PTR", "unshared handle %d (%d) (%s)", id, index, tag);
+        // drop the reference taken by the shared lock
+        ptr_release(ptr, id, index, tag);
+      } else {
+        __atomic_add_fetch(&ptr->sharing, 1, __ATOMIC_ACQ_REL);
+        p = NULL;
+      }
+      break;
+  }
+
+  if (!ok) {
+    ptr_release(ptr, id, index, tag);
   }
 
   return p;
@@ -286,6 +445,14 @@ void ptr_unlock_full(const char *file, const char *func, int line, int id, char
   ptr_access(file, func, line, id, tag, OP_UNLOCK, 0);
 }
 
+void *ptr_lock_shared_full(const char *file, const char *func, int line, int id, char *tag) {
+  return ptr_access(file, func, line, id, tag, OP_SHARE, 0);
+}
+
+void ptr_unlock_shared_full(const char *file, const char *func, int line, int id, char *tag) {
+  ptr_access(file, func, line, id, tag, OP_UNSHARE, 0);
+}
+
 int ptr_wait_full(const char *file, const char *func, int line, int id, int us, char *tag) {
   return ptr_access(file, func, line, id, tag, OP_WAIT, us) ? 0 : -1;
 }
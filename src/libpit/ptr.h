@@ -19,6 +19,10 @@ void *ptr_lock_full(const char *file, const char *func, int line, int id, char *
 
 void ptr_unlock_full(const char *file, const char *func, int line, int id, char *tag);
 
+void *ptr_lock_shared_full(const char *file, const char *func, int line, int id, char *tag);
+
+void ptr_unlock_shared_full(const char *file, const char *func, int line, int id, char *tag);
+
 int ptr_wait_full(const char *file, const char *func, int line, int id, int us, char *tag);
 
 int ptr_signal_full(const char *file, const char *func, int line, int id, char *tag);
@@ -28,6 +32,8 @@ int ptr_check_tag(char *received, char *expected);
 #define ptr_free(id, tag) ptr_free_full(__FILE__, __FUNCTION__, __LINE__, id, tag)
 #define ptr_lock(id, tag) ptr_lock_full(__FILE__, __FUNCTION__, __LINE__, id, tag)
 #define ptr_unlock(id, tag) ptr_unlock_full(__FILE__, __FUNCTION__, __LINE__, id, tag)
+#define ptr_lock_shared(id, tag) ptr_lock_shared_full(__FILE__, __FUNCTION__, __LINE__, id, tag)
+#define ptr_unlock_shared(id, tag) ptr_unlock_shared_full(__FILE__, __FUNCTION__, __LINE__, id, tag)
 #define ptr_wait(id, us, tag) ptr_wait_full(__FILE__, __FUNCTION__, __LINE__, id, us, tag)
 #define ptr_signal(id, tag) ptr_signal_full(__FILE__, __FUNCTION__, __LINE__, id, tag)
 
@@ -16,6 +16,7 @@
 #include "sim.h"
 #include "timeutc.h"
 #include "match.h"
+#include "trace.h"
 #include "debug.h"
 #include "xalloc.h"
 
@@ -24,11 +25,22 @@
 #define MAX_MODULE_NAME  256
 #define MAX_LIB_UNLOAD   256
 #define MAX_FILE_NAME    256
+#define MAX_POINTERS     64
+
+// Pointers set with script_set_pointer are also kept in the env, so that
+// providers can be looked up without locking the script engine. Entries are
+// only appended, and num_pointers is published after the entry is filled.
+typedef struct {
+  char *name;
+  void *p;
+} script_pointer_t;
 
 typedef struct {
   char *tag;
   script_priv_t *priv;
   script_ref_t cleanup;
+  script_pointer_t pointers[MAX_POINTERS];
+  int num_pointers;
 } script_env_t;
 
 static mutex_t *unload_mutex;
@@ -83,11 +95,15 @@ int script_finish(void) {
 
 static void script_destructor(void *p) {
   script_env_t *env;
+  int i;
 
   env = (script_env_t *)p;
 
   if (env) {
     dl_ext_script_destroy(env->priv);
+    for (i = 0; i < env->num_pointers; i++) {
+      xfree(env->pointers[i].name);
+    }
     xfree(env);
   }
 }
@@ -217,10 +233,12 @@ int script_call_args(int pe, script_ref_t ref, script_arg_t *ret, int n, script_
   int r = -1;
 
   if ((env = ptr_lock(pe, TAG_ENV)) != NULL) {
+    trace_begin("script", "call");
     r = dl_ext_script_call(env->priv, ref, ret, n, args);
     if (r == 0) {
       r = script_dup_string(ret);
     }
+    trace_end("script", "call");
     ptr_unlock(pe, TAG_ENV);
   }
 
@@ -457,19 +475,52 @@ int script_add_function(int pe, script_ref_t obj, char *name, int (*f)(int pe))
 }
 
 int script_set_pointer(int pe, char *name, void *p) {
+  script_env_t *env;
   script_arg_t value;
+  int i, r = -1;
 
   value.type = SCRIPT_ARG_POINTER;
   value.value.p = p;
 
-  return script_global_set(pe, name, &value);
+  if ((env = ptr_lock(pe, TAG_ENV)) != NULL) {
+    r = dl_ext_script_global_set(env->priv, name, &value);
+    if (r == 0) {
+      for (i = 0; i < env->num_pointers; i++) {
+        if (!strcmp(env->pointers[i].name, name)) break;
+      }
+      if (i < env->num_pointers) {
+        __atomic_store_n(&env->pointers[i].p, p, __ATOMIC_RELEASE);
+      } else if (i < MAX_POINTERS && (env->pointers[i].name = xstrdup(name)) != NULL) {
+        env->pointers[i].p = p;
+        __atomic_store_n(&env->num_pointers, i+1, __ATOMIC_RELEASE);
+      }
+    }
+    ptr_unlock(pe, TAG_ENV);
+  }
+
+  return r;
 }
 
 void *script_get_pointer(int pe, char *name) {
+  script_env_t *env;
   script_arg_t value;
   void *p = NULL;
+  int i, n, found = 0;
+
+  if ((env = ptr_lock_shared(pe, TAG_ENV)) != NULL) {
+    n = __atomic_load_n(&env->num_pointers, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+      if (!strcmp(env->pointers[i].name, name)) {
+        p = __atomic_load_n(&env->pointers[i].p, __ATOMIC_ACQUIRE);
+        found = 1;
+        break;
+      }
+    }
+    ptr_unlock_shared(pe, TAG_ENV);
+  }
 
-  if (script_global_get(pe, name, &value) == 0) {
+  // pointers set directly with script_global_set are only in the script engine
+  if (!found && script_global_get(pe, name, &value) == 0) {
     p = value.type == SCRIPT_ARG_POINTER ? value.value.p : NULL;
   }
 
@@ -767,6 +818,7 @@ script_ref_t script_loadlib(int pe, char *libname) {
       return -1;
     }
     debug(DEBUG_INFO, "SCRIPT", "%s library initialized", libname);
+    script_builtin_shell(pe);
 
   } else {
     debug(DEBUG_INFO, "SCRIPT", "no initializer found in library %s", libname);
@@ -55,6 +55,7 @@ int script_destroy(int ptr);
 // used by script.c / builtin.c
 
 int script_create_builtins(int pe, script_ref_t obj);
+int script_builtin_shell(int pe);
 script_ref_t script_loadlib(int pe, char *libname);
 int script_run(int pe, char *filename, int argc, char *argv[]);
 int script_match(int pe, char *f);
@@ -110,18 +110,37 @@ static int socket_select(int socket, uint32_t us, int nf) {
   struct timeval tv;
 #endif
   fd_set rfds;
-  int n, r;
+  int endfd, finishfd, nfds, n, r;
 
   FD_ZERO(&rfds);
   FD_SET(socket, &rfds);
+  nfds = socket + 1;
 
-  tv.tv_sec = 0;
-  tv.tv_usec = us;
-  n = select(nf ? (socket + 1) : 0, &rfds, NULL, NULL, us == ((uint32_t)-1) ? NULL : &tv);
+#ifdef WINDOWS
+  endfd = finishfd = -1;
+#else
+  // wake up as soon as the calling thread is asked to end
+  endfd = thread_get_fd();
+  finishfd = thread_get_finish_fd();
+  if (endfd != -1) {
+    FD_SET(endfd, &rfds);
+    if (endfd >= nfds) nfds = endfd + 1;
+  }
+  if (finishfd != -1) {
+    FD_SET(finishfd, &rfds);
+    if (finishfd >= nfds) nfds = finishfd + 1;
+  }
+#endif
+
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
+  n = select(nf ? nfds : 0, &rfds, NULL, NULL, us == ((uint32_t)-1) ? NULL : &tv);
 
   if (n == -1) {
     r = (errno == EINTR) ? 0 : -1; // a SIGCHLD can cause EINTR and it should not terminate the main thread wainting on its DGRAM socket
     debug_errno("SYS", "select socket");
+  } else if ((endfd != -1 && FD_ISSET(endfd, &rfds)) || (finishfd != -1 && FD_ISSET(finishfd, &rfds))) {
+    r = -1;
   } else if (n == 0 || !FD_ISSET(socket, &rfds)) {
     r = 0;
   } else {
@@ -11,15 +11,50 @@ extern "C" {
 #define STATUS_ERROR   1
 #define STATUS_FAULT   2
 
+#define THREAD_SCHED_OTHER 0
+#define THREAD_SCHED_FIFO  1
+#define THREAD_SCHED_RR    2
+
 typedef struct thread_key_t thread_key_t;
 
+typedef struct {
+  uint32_t cpus;   // CPU affinity mask, 0 means any CPU
+  int policy;      // THREAD_SCHED_*
+  int priority;    // real time priority for FIFO and RR
+  int nice;        // nice value for OTHER
+} thread_sched_t;
+
 typedef struct {
   uint32_t tid;
   int handle;
   char *name;
   double p;
+  int pooled;  // 1 if running on a thread_begin pool thread
+  thread_sched_t sched;  // effective settings
 } thread_ps_t;
 
+typedef struct {
+  uint32_t tid;
+  int handle;
+  char *name;
+  uint64_t msgs_in;       // messages received
+  uint64_t msgs_out;      // messages sent
+  uint32_t queued;        // messages waiting on the thread mailbox
+  uint32_t queued_bytes;  // bytes waiting on the thread mailbox
+  double wakeups;         // returns from blocking reads per second
+  uint64_t vcsw;          // voluntary context switches
+  uint64_t ivcsw;         // involuntary context switches
+  double cpu;             // share of one CPU used over the last few seconds
+  uint64_t mutex_wait;    // us spent blocked on mutexes
+} thread_stats_t;
+
+typedef struct {
+  uint64_t reads;      // calls to thread_server_read*
+  uint64_t messages;   // reads that returned a message
+  uint64_t allocated;  // bytes actually allocated for received messages
+  uint64_t saved;      // bytes not allocated compared to one 64 KB buffer per read
+} thread_rbuf_stats_t;
+
 void thread_init(void);
 
 void thread_close(void);
@@ -38,6 +73,8 @@ int thread_get_handle(void);
 
 int thread_get_fd(void);
 
+int thread_get_finish_fd(void);
+
 void *thread_setup(char *name);
 
 int thread_unsetup(void *p);
@@ -46,6 +83,10 @@ int thread_begin(char *tag, int action(void *arg), void *arg);
 
 int thread_begin2(char *tag, int action(void *arg), void *arg);
 
+int thread_begin_sched(char *tag, int action(void *arg), void *arg, thread_sched_t *sched);
+
+int thread_set_sched(int handle, thread_sched_t *sched);
+
 int thread_open_channel(int port);
 
 int thread_close_channel(int fd);
@@ -56,6 +97,8 @@ int thread_read_fd(int fd, uint32_t usec, unsigned char **rbuf, unsigned int *le
 
 int thread_client_write(int handle, unsigned char *buf, unsigned int len);
 
+int thread_client_post(int handle, void *buf, unsigned int len, void (*destructor)(void *buf));
+
 int thread_client_read(int handle, unsigned char **buf, unsigned int *len);
 
 int thread_client_read_timeout(int handle, uint32_t usec, unsigned char **buf, unsigned int *len);
@@ -68,6 +111,10 @@ int thread_server_read_timeout(uint32_t usec, unsigned char **buf, unsigned int
 
 int thread_server_read_timeout_from(uint32_t usec, unsigned char **buf, unsigned int *len, int *client);
 
+int thread_server_receive_timeout(uint32_t usec, void **buf, unsigned int *len, void (**destructor)(void *buf), int *client);
+
+int thread_set_queue_limit(unsigned int bytes);
+
 int thread_server_peek(void);
 
 int thread_end(char *tag, int handle);
@@ -80,6 +127,8 @@ void thread_set_name(char *name);
 
 void thread_get_name(char *name, int len);
 
+void thread_set_wait_timeout(uint32_t us);
+
 void thread_wait_all(void);
 
 void thread_set_flags(unsigned int mask);
@@ -94,6 +143,12 @@ unsigned int thread_get_flags(unsigned int mask);
 
 thread_ps_t *thread_ps(void);
 
+void thread_rbuf_stats(thread_rbuf_stats_t *st);
+
+thread_stats_t *thread_stats(void);
+
+void thread_mutex_wait(int64_t us);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,12 +6,19 @@
 #include <unistd.h>
 #define __USE_GNU
 #include <pthread.h>
+#include <sched.h>
 #undef __USE_GNU
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <errno.h>
 
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
+
 #include "thread.h"
+#include "mailbox.h"
 #include "mutex.h"
 #include "sys.h"
 #include "debug.h"
@@ -21,43 +28,235 @@
 
 #define MAX_PS_THREADS 256
 
+#define MAX_DGRAM 65536
+
+#define MAX_POOL_THREADS   (MAX_PS_THREADS-1)
+#define POOL_MIN_IDLE      2
+#define POOL_IDLE_TIMEOUT  30000000
+
+#define WAIT_TIMEOUT       20000000
+
+// minimum length of the window used for rates in thread_stats
+#define STATS_WINDOW       5000000
+
 struct thread_key_t {
   pthread_key_t key;
 };
 
-typedef struct {
+typedef struct thread_arg_t {
   char *name;
   int (*action)(void *arg);
   void *arg;
   int sock;
   int port;
   int psi;
-  uint64_t last_usage;
+  int pooled;
+  int starting;
+  int sched_set;
+  thread_sched_t sched;
+  int finish;
+  int endfd;
+  uint64_t msgs_in;
+  uint64_t msgs_out;
+  uint64_t wakeups;
+  uint64_t mutex_wait;
+  unsigned char *rbuf;
+  struct thread_arg_t *next;
 } thread_arg_t;
 
+typedef struct {
+  uint32_t tid;
+  pthread_t t;
+  int busy;
+} thread_worker_t;
+
+typedef struct {
+  int psi;
+  int handle;
+  char *name;
+  int64_t dt;
+} thread_exit_t;
+
+typedef struct {
+  int64_t t;
+  int64_t cpu;
+  uint64_t wakeups;
+} thread_sample_t;
+
 static thread_arg_t main_targ;
+static int use_mailbox;
 static thread_key_t *local;
 static thread_key_t *tname;
-static mutex_t *flags_mutex;
 static int flags, status;
+static int finish_fd;
 
 static mutex_t *mutex;
+static cond_t *exit_cond;
+static uint32_t wait_timeout;
 static unsigned int num_threads;
 static thread_ps_t ps[MAX_PS_THREADS];
+static thread_arg_t *ps_targ[MAX_PS_THREADS];
+static pthread_t ps_thread[MAX_PS_THREADS];
+static thread_sample_t ps_sample[MAX_PS_THREADS][2];
+static thread_rbuf_stats_t rbuf_stats;
+
+// worker pool used by thread_begin, protected by pool_mutex
+static mutex_t *pool_mutex;
+static cond_t *pool_cond;
+static thread_arg_t *pool_head, *pool_tail;
+static thread_worker_t pool_workers[MAX_POOL_THREADS];
+static int pool_size, pool_idle, pool_starting, pool_pending, pool_closing;
+
+// threads handed their job but not yet counted in num_threads, linked by
+// next; also protected by pool_mutex, which is always taken after mutex
+static thread_arg_t *starting_list;
+static int num_starting;
+
+// exit report of thread_wait_all while it waits, protected by mutex
+static thread_exit_t *wait_ex;
+static int wait_k, wait_size, waiting;
+
+// CPU time used by thread t in us, or -1
+static int64_t thread_cpu_time(pthread_t t) {
+#if defined(_POSIX_THREAD_CPUTIME) && !defined(WINDOWS)
+  struct timespec ts;
+  clockid_t cid;
+
+  if (pthread_getcpuclockid(t, &cid) == 0 && clock_gettime(cid, &ts) == 0) {
+    return ((int64_t)ts.tv_sec) * 1000000 + ((int64_t)ts.tv_nsec) / 1000;
+  }
+#endif
+
+  return -1;
+}
 
-static double thread_usage(void) {
-  int64_t tt, pt;
-  double p;
+// share of the process CPU time used by thread t
+static double thread_usage(pthread_t t, int64_t pt) {
+  int64_t tt;
 
-  tt = sys_get_thread_time();
-  pt = sys_get_process_time();
-  if (pt != 0) {
-    p = (double)tt / (double)(pt);
-  } else {
-    p = 0;
+  if (pt > 0 && (tt = thread_cpu_time(t)) >= 0) {
+    return (double)tt / (double)pt;
   }
 
-  return p;
+  return 0;
+}
+
+static void thread_ctx_switches(uint32_t tid, uint64_t *vcsw, uint64_t *ivcsw) {
+#ifdef LINUX
+  char buf[256];
+  unsigned long long n;
+  FILE *f;
+
+  snprintf(buf, sizeof(buf)-1, "/proc/self/task/%u/status", tid);
+  if ((f = fopen(buf, "r")) != NULL) {
+    for (; fgets(buf, sizeof(buf)-1, f);) {
+      if (sscanf(buf, "voluntary_ctxt_switches: %llu", &n) == 1) {
+        *vcsw = n;
+      } else if (sscanf(buf, "nonvoluntary_ctxt_switches: %llu", &n) == 1) {
+        *ivcsw = n;
+      }
+    }
+    fclose(f);
+  }
+#endif
+}
+
+static int thread_eventfd(void) {
+  int fd = -1;
+
+#ifdef LINUX
+  if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    debug_errno("THREAD", "eventfd");
+  }
+#endif
+
+  return fd;
+}
+
+// the fd is never read, so it stays readable once signaled
+static void thread_signal_fd(int fd) {
+  uint64_t one = 1;
+
+  if (fd != -1) {
+    if (write(fd, &one, sizeof(one)) == -1) {
+      // nothing to do, a pending signal is already enough
+    }
+  }
+}
+
+static int thread_apply_sched(pthread_t t, uint32_t tid, thread_sched_t *sched) {
+#ifdef LINUX
+  struct sched_param param;
+  cpu_set_t set;
+  int i, policy, err, r = 0;
+
+  if (sched->cpus) {
+    CPU_ZERO(&set);
+    for (i = 0; i < 32; i++) {
+      if (sched->cpus & (1U << i)) CPU_SET(i, &set);
+    }
+    if ((err = pthread_setaffinity_np(t, sizeof(set), &set)) != 0) {
+      errno = err;
+      debug_errno("THREAD", "pthread_setaffinity_np");
+      r = -1;
+    }
+  }
+
+  switch (sched->policy) {
+    case THREAD_SCHED_FIFO: policy = SCHED_FIFO;  break;
+    case THREAD_SCHED_RR:   policy = SCHED_RR;    break;
+    default:                policy = SCHED_OTHER; break;
+  }
+  param.sched_priority = policy == SCHED_OTHER ? 0 : sched->priority;
+
+  if ((err = pthread_setschedparam(t, policy, &param)) != 0) {
+    errno = err;
+    debug_errno("THREAD", "pthread_setschedparam");
+    r = -1;
+  }
+
+  // on Linux the nice value is per thread
+  if (policy == SCHED_OTHER && setpriority(PRIO_PROCESS, tid, sched->nice) == -1) {
+    debug_errno("THREAD", "setpriority");
+    r = -1;
+  }
+
+  return r;
+#else
+  debug(DEBUG_ERROR, "THREAD", "thread scheduling is not supported on this platform");
+  return -1;
+#endif
+}
+
+static void thread_get_sched(pthread_t t, uint32_t tid, thread_sched_t *sched) {
+#ifdef LINUX
+  struct sched_param param;
+  cpu_set_t set;
+  int i, policy;
+
+  xmemset(sched, 0, sizeof(thread_sched_t));
+
+  if (pthread_getaffinity_np(t, sizeof(set), &set) == 0) {
+    for (i = 0; i < 32; i++) {
+      if (CPU_ISSET(i, &set)) sched->cpus |= 1U << i;
+    }
+  }
+
+  if (pthread_getschedparam(t, &policy, &param) == 0) {
+    switch (policy) {
+      case SCHED_FIFO: sched->policy = THREAD_SCHED_FIFO;  break;
+      case SCHED_RR:   sched->policy = THREAD_SCHED_RR;    break;
+      default:         sched->policy = THREAD_SCHED_OTHER; break;
+    }
+    sched->priority = param.sched_priority;
+  }
+
+  errno = 0;
+  sched->nice = getpriority(PRIO_PROCESS, tid);
+  if (errno) sched->nice = 0;
+#else
+  xmemset(sched, 0, sizeof(thread_sched_t));
+#endif
 }
 
 static void dummy_destructor(void *value) {
@@ -96,40 +295,126 @@ static void thread_detach(void) {
   pthread_detach(pthread_self());
 }
 
+// a thread channel is either a mailbox or a loopback UDP socket bound to port
+static int thread_channel_open(int *sock, int *port) {
+  if (use_mailbox) {
+    *sock = -1;
+    if ((*port = mailbox_create()) == -1) {
+      return -1;
+    }
+    debug(DEBUG_INFO, "THREAD", "thread mailbox %d created", *port);
+    return 0;
+  }
+
+  *port = 0;
+  if ((*sock = sys_socket_bind(LOCALHOST, port, IP_DGRAM)) == -1) {
+    return -1;
+  }
+  debug(DEBUG_INFO, "THREAD", "thread sock %d bound to port %d", *sock, *port);
+  return 0;
+}
+
+static void thread_channel_close(int sock, int port) {
+  if (use_mailbox) {
+    mailbox_destroy(port);
+  } else if (sock > 0) {
+    sys_close(sock);
+  }
+}
+
 void thread_init(void) {
   int port;
 
   local = thread_key();
   tname = thread_key();
 
+#ifdef THREAD_UDP
+  use_mailbox = 0;
+#else
+  use_mailbox = mailbox_init() == 0;
+#endif
+  debug(DEBUG_INFO, "THREAD", "using %s thread channels", use_mailbox ? "mailbox" : "UDP");
+
   memset(&main_targ, 0, sizeof(main_targ));
-  main_targ.sock = sys_socket_bind(LOCALHOST, &port, IP_DGRAM);
+  thread_channel_open(&main_targ.sock, &port);
+  main_targ.port = port;
   main_targ.psi = 0;
+  main_targ.endfd = -1;
 
   thread_set(local, &main_targ);
   thread_set(tname, "MAIN");
 
   xmemset(ps, 0, sizeof(ps));
+  xmemset(ps_targ, 0, sizeof(ps_targ));
   ps[0].handle = port;
   ps[0].name = "MAIN";
+  ps_targ[0] = &main_targ;
 
-  flags_mutex = mutex_create("thread_flags");
   status = STATUS_SUCCESS;
   flags = 0;
+  finish_fd = thread_eventfd();
 
-  mutex = mutex_create("thread");
+  mutex = mutex_create_fast("thread");
+  exit_cond = cond_create("thread_exit");
+  wait_timeout = WAIT_TIMEOUT;
   num_threads = 0;
+
+  pool_mutex = mutex_create_fast("thread_pool");
+  pool_cond = cond_create("thread_pool");
+  pool_head = pool_tail = NULL;
+  xmemset(pool_workers, 0, sizeof(pool_workers));
+  pool_size = pool_idle = pool_starting = pool_pending = pool_closing = 0;
+  starting_list = NULL;
+  num_starting = 0;
 }
 
 void thread_setmain(void) {
   ps[0].tid = sys_get_tid();
+  ps_thread[0] = pthread_self();
+  ps_sample[0][0].t = sys_get_clock();
+  ps_sample[0][1] = ps_sample[0][0];
+}
+
+static void thread_pool_close(void) {
+  int i, n;
+
+  if (mutex_lock(pool_mutex) == 0) {
+    pool_closing = 1;
+    cond_broadcast(pool_cond);
+    for (i = 0; i < 20 && pool_size > 0; i++) {
+      cond_timedwait(pool_cond, pool_mutex, 50000);
+    }
+    n = pool_size;
+    mutex_unlock(pool_mutex);
+
+    if (n == 0) {
+      debug(DEBUG_INFO, "THREAD", "pool closed");
+      cond_destroy(pool_cond);
+      mutex_destroy(pool_mutex);
+    } else {
+      debug(DEBUG_ERROR, "THREAD", "%d pool thread(s) still running", n);
+    }
+  }
 }
 
 void thread_close(void) {
-  if (main_targ.sock > 0) {
-    sys_close(main_targ.sock);
+  thread_rbuf_stats_t st;
+
+  thread_pool_close();
+
+  thread_rbuf_stats(&st);
+  debug(DEBUG_INFO, "THREAD", "receive buffers: %llu reads, %llu messages, %llu bytes allocated, %llu bytes saved",
+    (unsigned long long)st.reads, (unsigned long long)st.messages, (unsigned long long)st.allocated, (unsigned long long)st.saved);
+
+  thread_channel_close(main_targ.sock, main_targ.port);
+  if (main_targ.rbuf) xfree(main_targ.rbuf);
+  if (use_mailbox) {
+    mailbox_close();
   }
-  mutex_destroy(flags_mutex);
+  if (main_targ.endfd != -1) sys_close(main_targ.endfd);
+  if (finish_fd != -1) sys_close(finish_fd);
+  finish_fd = -1;
+  cond_destroy(exit_cond);
   mutex_destroy(mutex);
 }
 
@@ -167,34 +452,54 @@ int thread_get_handle(void) {
   return targ ? targ->port : -1;
 }
 
+// called on every iteration of every worker loop, so it must stay cheap
 int thread_must_end(void) {
   thread_arg_t *targ;
-  double p;
-  uint64_t t;
 
-  if (thread_get_flags(FLAG_FINISH)) {
+  if (__atomic_load_n(&flags, __ATOMIC_ACQUIRE) & FLAG_FINISH) {
     debug(DEBUG_INFO, "THREAD", "thread must end (flag)");
     return 1;
   }
 
   targ = (thread_arg_t *)thread_get(local);
 
-  if (targ == NULL || targ->sock <= 0 || sys_peek(targ->sock) != -1) {
-    t = sys_time();
-    if ((t - targ->last_usage) >= 15) {
-      p = thread_usage();
-      targ->last_usage = t;
-      if (mutex_lock(mutex) == 0) {
-        ps[targ->psi].p = p;
-        mutex_unlock(mutex);
+  if (targ && __atomic_load_n(&targ->finish, __ATOMIC_ACQUIRE)) {
+    debug(DEBUG_INFO, "THREAD", "thread port %d must end", targ->port);
+    return 1;
+  }
+
+  return 0;
+}
+
+// fd that becomes readable when the calling thread must end
+int thread_get_fd(void) {
+  thread_arg_t *targ;
+  int fd = -1;
+
+  targ = (thread_arg_t *)thread_get(local);
+  if (targ) {
+    fd = __atomic_load_n(&targ->endfd, __ATOMIC_ACQUIRE);
+    if (fd == -1 && mutex_lock(mutex) == 0) {
+      if (targ->endfd == -1) {
+        targ->endfd = thread_eventfd();
+        if (targ->finish) thread_signal_fd(targ->endfd);
       }
+      fd = targ->endfd;
+      mutex_unlock(mutex);
     }
-
-    return 0;
   }
 
-  debug(DEBUG_INFO, "THREAD", "thread port %d must end", targ->port);
-  return 1;
+  return fd;
+}
+
+// fd that becomes readable when the whole process must end
+int thread_get_finish_fd(void) {
+  thread_arg_t *targ;
+
+  targ = (thread_arg_t *)thread_get(local);
+
+  // the main thread keeps running during shutdown
+  return targ == &main_targ ? -1 : finish_fd;
 }
 
 void *thread_setup(char *name) {
@@ -203,17 +508,17 @@ void *thread_setup(char *name) {
 
   targ = (thread_arg_t *)thread_get(local);
   if (targ == NULL) {
-    port = 0;
-    if ((sock = sys_socket_bind(LOCALHOST, &port, IP_DGRAM)) != -1) {
+    if (thread_channel_open(&sock, &port) == 0) {
       if ((targ = xcalloc(1, sizeof(thread_arg_t))) != NULL) {
         targ->name = name;
         targ->sock = sock;
         targ->port = port;
+        targ->endfd = -1;
         thread_set(local, targ);
         thread_set_name(name);
+      } else {
+        thread_channel_close(sock, port);
       }
-    } else {
-      sys_close(sock);
     }
   }
 
@@ -226,7 +531,9 @@ int thread_unsetup(void *p) {
 
   targ = (thread_arg_t *)p;
   if (targ) {
-    if (targ->sock) sys_close(targ->sock);
+    thread_channel_close(targ->sock, targ->port);
+    if (targ->endfd != -1) sys_close(targ->endfd);
+    if (targ->rbuf) xfree(targ->rbuf);
     xfree(targ);
     r = 0;
   }
@@ -234,14 +541,50 @@ int thread_unsetup(void *p) {
   return r;
 }
 
-static void *thread_action(void *arg) {
-  thread_arg_t *targ;
-  uint32_t tid;
-  int i;
+// called with pool_mutex locked
+static void thread_starting_add(thread_arg_t *targ) {
+  targ->next = starting_list;
+  starting_list = targ;
+  targ->starting = 1;
+  num_starting++;
+}
 
-  targ = (thread_arg_t *)arg;
-  thread_detach();
-  sys_block_signals();
+// called with pool_mutex locked
+static void thread_starting_remove(thread_arg_t *targ) {
+  thread_arg_t **p;
+
+  for (p = &starting_list; *p; p = &(*p)->next) {
+    if (*p == targ) {
+      *p = targ->next;
+      break;
+    }
+  }
+  targ->next = NULL;
+  targ->starting = 0;
+  num_starting--;
+}
+
+// adds thread i to the exit report of thread_wait_all, called with mutex locked
+static void thread_exit_add(int i) {
+  thread_exit_t *p;
+
+  if (wait_k == wait_size) {
+    if ((p = xrealloc(wait_ex, (wait_size + MAX_PS_THREADS) * sizeof(thread_exit_t))) == NULL) return;
+    wait_ex = p;
+    wait_size += MAX_PS_THREADS;
+  }
+  wait_ex[wait_k].psi = i;
+  wait_ex[wait_k].handle = ps[i].handle;
+  wait_ex[wait_k].name = xstrdup(ps[i].name);
+  wait_ex[wait_k].dt = -1;
+  wait_k++;
+}
+
+// runs targ on the calling thread and frees it
+// returns 1 if the scheduling settings of the thread were changed
+static int thread_run(thread_arg_t *targ) {
+  uint32_t tid;
+  int i, sched_set;
 
   thread_set(local, targ);
   thread_set_name(targ->name);
@@ -249,23 +592,42 @@ static void *thread_action(void *arg) {
 
   if (mutex_lock(mutex) == 0) {
     num_threads++;
+    if (targ->starting && mutex_lock(pool_mutex) == 0) {
+      // counted as running without a gap, see thread_running
+      thread_starting_remove(targ);
+      mutex_unlock(pool_mutex);
+    }
     for (i = 1; i < MAX_PS_THREADS; i++) {
       if (ps[i].tid == 0) {
         ps[i].tid = tid;
         ps[i].handle = targ->port;
         ps[i].name = targ->name;
         ps[i].p = 0;
+        ps[i].pooled = targ->pooled;
+        xmemset(&ps[i].sched, 0, sizeof(thread_sched_t));
+        ps_sample[i][0].t = sys_get_clock();
+        ps_sample[i][0].cpu = 0;
+        ps_sample[i][0].wakeups = 0;
+        ps_sample[i][1] = ps_sample[i][0];
+        ps_targ[i] = targ;
+        ps_thread[i] = pthread_self();
         targ->psi = i;
+        if (waiting) thread_exit_add(i);
         break;
       }
     }
     mutex_unlock(mutex);
   }
 
+  if (targ->sched_set) {
+    thread_apply_sched(pthread_self(), tid, &targ->sched);
+  }
+
   debug(DEBUG_INFO, "THREAD", "thread port %d begin", targ->port);
   targ->action(targ->arg);
   debug(DEBUG_INFO, "THREAD", "thread port %d end", targ->port);
-  sys_close(targ->sock);
+  thread_channel_close(targ->sock, targ->port);
+  if (targ->rbuf) xfree(targ->rbuf);
 
   if (mutex_lock(mutex) == 0) {
     num_threads--;
@@ -275,43 +637,248 @@ static void *thread_action(void *arg) {
         ps[i].handle = 0;
         ps[i].name = NULL;
         ps[i].p = 0;
+        ps_targ[i] = NULL;
         break;
       }
     }
+    cond_broadcast(exit_cond);
     mutex_unlock(mutex);
   }
 
+  if (targ->endfd != -1) sys_close(targ->endfd);
+  sched_set = __atomic_load_n(&targ->sched_set, __ATOMIC_ACQUIRE);
+
   thread_set(local, NULL);
   xfree(targ);
   thread_set(tname, NULL);
 
+  return sched_set;
+}
+
+static void *thread_action(void *arg) {
+  thread_detach();
+  sys_block_signals();
+  thread_run((thread_arg_t *)arg);
+
   return NULL;
 }
 
+static void *thread_worker(void *arg) {
+  thread_worker_t *w;
+  thread_arg_t *targ;
+  int r;
+
+  w = (thread_worker_t *)arg;
+  thread_detach();
+  sys_block_signals();
+  thread_set_name("POOL");
+
+  if (mutex_lock(pool_mutex) == 0) {
+    w->tid = sys_get_tid();
+    w->t = pthread_self();
+    pool_starting--;
+
+    for (;;) {
+      for (r = 0; pool_head == NULL && !pool_closing;) {
+        pool_idle++;
+        r = cond_timedwait(pool_cond, pool_mutex, POOL_IDLE_TIMEOUT);
+        pool_idle--;
+        // shrink when idle for too long and enough other workers are idle
+        if (r == -1 && pool_head == NULL && pool_idle >= POOL_MIN_IDLE) break;
+      }
+      if (pool_head == NULL) break;
+
+      targ = pool_head;
+      pool_head = targ->next;
+      if (pool_head == NULL) pool_tail = NULL;
+      targ->next = NULL;
+      pool_pending--;
+      thread_starting_add(targ);
+      w->busy = 1;
+      mutex_unlock(pool_mutex);
+
+      // a thread with custom scheduling settings is not reused
+      r = thread_run(targ);
+      thread_set_name("POOL");
+
+      mutex_lock(pool_mutex);
+      w->busy = 0;
+      if (r) break;
+    }
+
+    debug(DEBUG_INFO, "THREAD", "pool thread exiting (%d left)", pool_size - 1);
+    w->tid = 0;
+    pool_size--;
+    cond_broadcast(pool_cond);
+    mutex_unlock(pool_mutex);
+  }
+
+  return NULL;
+}
+
+// Queues targ if an idle pool thread can take it, or if a new pool thread
+// could be started for it. Returns 1 when the pool cannot run targ, since
+// most jobs keep their thread until the end of the program.
+static int thread_pool_submit(thread_arg_t *targ) {
+  int i, r = -1;
+
+  if (mutex_lock(pool_mutex) == 0) {
+    if (!pool_closing) {
+      r = 0;
+      if (pool_pending + 1 > pool_idle + pool_starting) {
+        r = 1;
+        if (pool_size < MAX_POOL_THREADS) {
+          for (i = 0; i < MAX_POOL_THREADS && pool_workers[i].tid; i++);
+          pool_workers[i].tid = (uint32_t)-1; // reserved until the worker starts
+          pool_workers[i].busy = 0;
+          if (thread_create(thread_worker, &pool_workers[i]) == 0) {
+            pool_size++;
+            pool_starting++;
+            debug(DEBUG_INFO, "THREAD", "pool grown to %d thread(s)", pool_size);
+            r = 0;
+          } else {
+            pool_workers[i].tid = 0;
+          }
+        } else {
+          debug(DEBUG_INFO, "THREAD", "pool is full, starting a dedicated thread");
+        }
+      }
+
+      if (r == 0) {
+        targ->next = NULL;
+        targ->pooled = 1;
+        if (pool_tail) {
+          pool_tail->next = targ;
+        } else {
+          pool_head = targ;
+        }
+        pool_tail = targ;
+        pool_pending++;
+        cond_signal(pool_cond);
+      }
+    }
+    mutex_unlock(pool_mutex);
+  }
+
+  return r;
+}
+
+void thread_rbuf_stats(thread_rbuf_stats_t *st) {
+  st->reads = __atomic_load_n(&rbuf_stats.reads, __ATOMIC_RELAXED);
+  st->messages = __atomic_load_n(&rbuf_stats.messages, __ATOMIC_RELAXED);
+  st->allocated = __atomic_load_n(&rbuf_stats.allocated, __ATOMIC_RELAXED);
+  st->saved = __atomic_load_n(&rbuf_stats.saved, __ATOMIC_RELAXED);
+}
+
+// idle pool threads are listed with handle -1
 thread_ps_t *thread_ps(void) {
   thread_ps_t *r = NULL;
+  int64_t pt;
+  int i, j;
+
+  pt = sys_get_process_time();
+
+  if (mutex_lock(mutex) == 0) {
+    if (mutex_lock(pool_mutex) == 0) {
+      if ((r = xcalloc(num_threads+pool_size+2, sizeof(thread_ps_t))) != NULL) {
+        if (ps[0].tid) ps[0].p = thread_usage(ps_thread[0], pt);
+        r[0].tid = ps[0].tid;
+        r[0].handle = ps[0].handle;
+        r[0].name = xstrdup(ps[0].name);
+        r[0].p = ps[0].p;
+        if (ps[0].tid) thread_get_sched(ps_thread[0], ps[0].tid, &r[0].sched);
+
+        for (i = 1, j = 1; i < MAX_PS_THREADS && j <= num_threads; i++) {
+          if (ps[i].tid) {
+            ps[i].p = thread_usage(ps_thread[i], pt);
+            r[j].tid = ps[i].tid;
+            r[j].handle = ps[i].handle;
+            r[j].name = xstrdup(ps[i].name);
+            r[j].p = ps[i].p;
+            r[j].pooled = ps[i].pooled;
+            thread_get_sched(ps_thread[i], ps[i].tid, &r[j].sched);
+            j++;
+          }
+        }
+
+        for (i = 0; i < MAX_POOL_THREADS; i++) {
+          if (pool_workers[i].tid && pool_workers[i].tid != (uint32_t)-1 && !pool_workers[i].busy) {
+            r[j].tid = pool_workers[i].tid;
+            r[j].handle = -1;
+            r[j].name = xstrdup("POOL");
+            r[j].p = thread_usage(pool_workers[i].t, pt);
+            r[j].pooled = 1;
+            thread_get_sched(pool_workers[i].t, pool_workers[i].tid, &r[j].sched);
+            j++;
+          }
+        }
+        debug(DEBUG_TRACE, "THREAD", "pool: %d thread(s), %d idle, %d queued", pool_size, pool_idle, pool_pending);
+      }
+      mutex_unlock(pool_mutex);
+    }
+    mutex_unlock(mutex);
+  }
+
+  return r;
+}
+
+// called by mutex_lock when the calling thread had to block
+void thread_mutex_wait(int64_t us) {
+  thread_arg_t *targ;
+
+  if (local && (targ = (thread_arg_t *)thread_get(local)) != NULL) {
+    __atomic_add_fetch(&targ->mutex_wait, us, __ATOMIC_RELAXED);
+  }
+}
+
+// rates are computed over the last STATS_WINDOW to 2*STATS_WINDOW us
+thread_stats_t *thread_stats(void) {
+  thread_stats_t *r = NULL;
+  thread_sample_t *s0, *s1, now;
+  thread_arg_t *targ;
+  int64_t dt;
   int i, j;
 
   if (mutex_lock(mutex) == 0) {
-    if ((r = xcalloc(num_threads+2, sizeof(thread_ps_t))) != NULL) {
-      r[0].tid = ps[0].tid;
-      r[0].handle = ps[0].handle;
-      r[0].name = xstrdup(ps[0].name);
-      r[0].p = ps[0].p;
-
-      for (i = 1, j = 0; i < MAX_PS_THREADS && j < num_threads; i++) {
-        if (ps[i].tid) {
-          r[j+1].tid = ps[i].tid;
-          r[j+1].handle = ps[i].handle;
-          r[j+1].name = xstrdup(ps[i].name);
-          r[j+1].p = ps[i].p;
-          j++;
+    if ((r = xcalloc(num_threads+2, sizeof(thread_stats_t))) != NULL) {
+      now.t = sys_get_clock();
+
+      for (i = 0, j = 0; i < MAX_PS_THREADS && j <= num_threads; i++) {
+        if (ps[i].tid == 0 || (targ = ps_targ[i]) == NULL) continue;
+
+        r[j].tid = ps[i].tid;
+        r[j].handle = ps[i].handle;
+        r[j].name = xstrdup(ps[i].name);
+        r[j].msgs_in = __atomic_load_n(&targ->msgs_in, __ATOMIC_RELAXED);
+        r[j].msgs_out = __atomic_load_n(&targ->msgs_out, __ATOMIC_RELAXED);
+        r[j].mutex_wait = __atomic_load_n(&targ->mutex_wait, __ATOMIC_RELAXED);
+        if (use_mailbox) {
+          mailbox_depth(targ->port, &r[j].queued, &r[j].queued_bytes);
+        }
+
+        now.cpu = thread_cpu_time(ps_thread[i]);
+        now.wakeups = __atomic_load_n(&targ->wakeups, __ATOMIC_RELAXED);
+        s0 = &ps_sample[i][0];
+        s1 = &ps_sample[i][1];
+        if (now.t - s1->t >= STATS_WINDOW) {
+          *s0 = *s1;
+          *s1 = now;
+        }
+        if ((dt = now.t - s0->t) > 0) {
+          r[j].cpu = now.cpu >= 0 ? (double)(now.cpu - s0->cpu) / (double)dt : 0;
+          r[j].wakeups = (double)(now.wakeups - s0->wakeups) * 1000000.0 / (double)dt;
         }
+        j++;
       }
     }
     mutex_unlock(mutex);
   }
 
+  // outside of the lock, this reads /proc
+  for (j = 0; r && r[j].tid; j++) {
+    thread_ctx_switches(r[j].tid, &r[j].vcsw, &r[j].ivcsw);
+  }
+
   return r;
 }
 
@@ -319,13 +886,12 @@ int thread_begin2(char *tag, int action(void *arg), void *arg) {
   thread_arg_t *targ;
   int sock, port;
 
-  port = 0;
-  if ((sock = sys_socket_bind(LOCALHOST, &port, IP_DGRAM)) == -1) {
+  if (thread_channel_open(&sock, &port) == -1) {
     return -1;
   }
 
   if ((targ = xcalloc(1, sizeof(thread_arg_t))) == NULL) {
-    sys_close(sock);
+    thread_channel_close(sock, port);
     return -1;
   }
 
@@ -334,12 +900,27 @@ int thread_begin2(char *tag, int action(void *arg), void *arg) {
   targ->arg = arg;
   targ->sock = sock;
   targ->port = port;
-  debug(DEBUG_INFO, "THREAD", "thread sock %d bound to port %d", sock, port);
+  targ->endfd = -1;
 
   thread_action(targ);
 
-  sys_close(sock);
-  xfree(targ);
+  return 0;
+}
+
+// runs targ on a thread of its own, counted as running until it registers
+static int thread_start(thread_arg_t *targ) {
+  if (mutex_lock(pool_mutex) == 0) {
+    thread_starting_add(targ);
+    mutex_unlock(pool_mutex);
+  }
+
+  if (thread_create(thread_action, targ) == -1) {
+    if (targ->starting && mutex_lock(pool_mutex) == 0) {
+      thread_starting_remove(targ);
+      mutex_unlock(pool_mutex);
+    }
+    return -1;
+  }
 
   return 0;
 }
@@ -348,13 +929,12 @@ int thread_begin(char *tag, int action(void *arg), void *arg) {
   thread_arg_t *targ;
   int sock, port;
 
-  port = 0;
-  if ((sock = sys_socket_bind(LOCALHOST, &port, IP_DGRAM)) == -1) {
+  if (thread_channel_open(&sock, &port) == -1) {
     return -1;
   }
 
   if ((targ = xcalloc(1, sizeof(thread_arg_t))) == NULL) {
-    sys_close(sock);
+    thread_channel_close(sock, port);
     return -1;
   }
 
@@ -363,10 +943,50 @@ int thread_begin(char *tag, int action(void *arg), void *arg) {
   targ->arg = arg;
   targ->sock = sock;
   targ->port = port;
-  debug(DEBUG_INFO, "THREAD", "thread sock %d bound to port %d", sock, port);
+  targ->endfd = -1;
+
+  switch (thread_pool_submit(targ)) {
+    case 0:
+      break;
+    case 1:
+      if (thread_start(targ) == 0) break;
+      // fall through
+    default:
+      thread_channel_close(sock, port);
+      xfree(targ);
+      return -1;
+  }
 
-  if (thread_create(thread_action, targ) == -1) {
-    sys_close(sock);
+  return port;
+}
+
+// runs on a dedicated thread, since a pooled thread would keep the settings
+int thread_begin_sched(char *tag, int action(void *arg), void *arg, thread_sched_t *sched) {
+  thread_arg_t *targ;
+  int sock, port;
+
+  if (thread_channel_open(&sock, &port) == -1) {
+    return -1;
+  }
+
+  if ((targ = xcalloc(1, sizeof(thread_arg_t))) == NULL) {
+    thread_channel_close(sock, port);
+    return -1;
+  }
+
+  targ->name = tag;
+  targ->action = action;
+  targ->arg = arg;
+  targ->sock = sock;
+  targ->port = port;
+  targ->endfd = -1;
+  if (sched) {
+    targ->sched = *sched;
+    targ->sched_set = 1;
+  }
+
+  if (thread_start(targ) == -1) {
+    thread_channel_close(sock, port);
     xfree(targ);
     return -1;
   }
@@ -374,19 +994,61 @@ int thread_begin(char *tag, int action(void *arg), void *arg) {
   return port;
 }
 
+int thread_set_sched(int handle, thread_sched_t *sched) {
+  int i, r = -1;
+
+  if (mutex_lock(mutex) == 0) {
+    for (i = 0; i < MAX_PS_THREADS; i++) {
+      if (ps[i].tid && ps[i].handle == handle) {
+        debug(DEBUG_INFO, "THREAD", "thread %s (%d) cpus 0x%08X policy %d priority %d nice %d",
+          ps[i].name, handle, sched->cpus, sched->policy, sched->priority, sched->nice);
+        r = thread_apply_sched(ps_thread[i], ps[i].tid, sched);
+        if (i > 0) __atomic_store_n(&ps_targ[i]->sched_set, 1, __ATOMIC_RELEASE);
+        break;
+      }
+    }
+    mutex_unlock(mutex);
+
+    if (i == MAX_PS_THREADS) {
+      debug(DEBUG_ERROR, "THREAD", "thread %d not found", handle);
+    }
+  }
+
+  return r;
+}
+
+static void thread_count_out(void) {
+  thread_arg_t *targ;
+
+  if ((targ = (thread_arg_t *)thread_get(local)) != NULL) {
+    __atomic_add_fetch(&targ->msgs_out, 1, __ATOMIC_RELAXED);
+  }
+}
+
 static int thread_write_port(int port, unsigned char *buf, unsigned int len) {
   int sock, r;
 
-  sock = thread_get_sock();
-  r = sys_socket_sendto(sock, LOCALHOST, port, buf, len);
-  if (r == -1) {
-    debug(DEBUG_ERROR, "THREAD", "write to port %d from sock %d failed", port, sock);
+  if (use_mailbox) {
+    r = mailbox_write(port, thread_get_handle(), buf, len);
+  } else {
+    sock = thread_get_sock();
+    r = sys_socket_sendto(sock, LOCALHOST, port, buf, len);
+    if (r == -1) {
+      debug(DEBUG_ERROR, "THREAD", "write to port %d from sock %d failed", port, sock);
+    }
+    r = r == len ? len : -1;
+  }
+
+  if (r > 0 || (r == 0 && len == 0)) {
+    thread_count_out();
   }
 
-  return r == len ? len : -1;
+  return r;
 }
 
-static int thread_read_sock(int sock, uint32_t usec, unsigned char **rbuf, unsigned int *len, int *client) {
+// datagrams are received into a per thread buffer; the caller only gets
+// (and must free) an exact sized copy when a message actually arrived
+static int thread_read_sock(thread_arg_t *targ, uint32_t usec, unsigned char **rbuf, unsigned int *len, int *client) {
   struct timeval tv;
   uint8_t *buf;
   char host[32];
@@ -395,31 +1057,43 @@ static int thread_read_sock(int sock, uint32_t usec, unsigned char **rbuf, unsig
   *rbuf = NULL;
   *len = 0;
 
-  if ((buf = xcalloc(1, 65536)) == NULL) {
+  if (targ == NULL) {
     return -1;
   }
 
+  if (targ->rbuf == NULL) {
+    if ((targ->rbuf = xmalloc_raw(MAX_DGRAM)) == NULL) {
+      return -1;
+    }
+    __atomic_add_fetch(&rbuf_stats.allocated, MAX_DGRAM, __ATOMIC_RELAXED);
+  }
+
   tv.tv_sec = 0;
   tv.tv_usec = usec;
-  n = sys_socket_recvfrom(sock, host, sizeof(host)-1, &port, buf, 65536, usec == ((uint32_t)-1) ? NULL : &tv);
+  n = sys_socket_recvfrom(targ->sock, host, sizeof(host)-1, &port, targ->rbuf, MAX_DGRAM, usec == ((uint32_t)-1) ? NULL : &tv);
 
   if (n < 0) {
-    debug(DEBUG_ERROR, "THREAD", "read from sock %d failed", sock);
-    xfree(buf);
+    if (!thread_must_end()) {
+      debug(DEBUG_ERROR, "THREAD", "read from sock %d failed", targ->sock);
+    }
     return -1;
   }
 
   if (n == 0) {
-    xfree(buf);
     return 0;
   }
 
-  if (n == 1 && buf[0] == 0) {
+  if (n == 1 && targ->rbuf[0] == 0) {
     debug(DEBUG_INFO, "THREAD", "received finish packet");
-    xfree(buf);
+    __atomic_store_n(&targ->finish, 1, __ATOMIC_RELEASE);
     return -1;
   }
 
+  if ((buf = xmalloc_raw(n)) == NULL) {
+    return -1;
+  }
+  xmemcpy(buf, targ->rbuf, n);
+  __atomic_add_fetch(&rbuf_stats.allocated, n, __ATOMIC_RELAXED);
 
   *rbuf = buf;
   *len = n;
@@ -428,11 +1102,65 @@ static int thread_read_sock(int sock, uint32_t usec, unsigned char **rbuf, unsig
   return 1;
 }
 
+static int thread_read_mailbox(int handle, uint32_t usec, void **rbuf, unsigned int *len, void (**destructor)(void *buf), int *client) {
+  int r;
+
+  if ((r = mailbox_receive(handle, usec, rbuf, len, destructor, client)) != 1) {
+    return r;
+  }
+
+  if (*len == 0) {
+    return 0;
+  }
+  if (*destructor == NULL) {
+    __atomic_add_fetch(&rbuf_stats.allocated, *len, __ATOMIC_RELAXED);
+  }
+
+  if (*len == 1 && *destructor == NULL && ((unsigned char *)*rbuf)[0] == 0) {
+    debug(DEBUG_INFO, "THREAD", "received finish packet");
+    __atomic_store_n(&((thread_arg_t *)thread_get(local))->finish, 1, __ATOMIC_RELEASE);
+    xfree(*rbuf);
+    *rbuf = NULL;
+    *len = 0;
+    return -1;
+  }
+
+  return 1;
+}
+
 // used by thread clients
 int thread_client_write(int port, unsigned char *buf, unsigned int len) {
   return thread_write_port(port, buf, len);
 }
 
+// used by thread clients
+int thread_client_post(int handle, void *buf, unsigned int len, void (*destructor)(void *buf)) {
+  int r;
+
+  if (use_mailbox) {
+    if ((r = mailbox_post(handle, thread_get_handle(), buf, len, destructor)) > 0) {
+      thread_count_out();
+    }
+    return r;
+  }
+
+  // datagrams are always copied, so buf is released as soon as it is sent
+  if (len > MAX_DGRAM) {
+    debug(DEBUG_ERROR, "THREAD", "message of %u bytes is too large for port %d", len, handle);
+    return -1;
+  }
+
+  if ((r = thread_write_port(handle, buf, len)) == len) {
+    if (destructor) {
+      destructor(buf);
+    } else {
+      xfree(buf);
+    }
+  }
+
+  return r;
+}
+
 // used by thread clients
 int thread_client_read_timeout(int handle, uint32_t usec, unsigned char **buf, unsigned int *len) {
   //return thread_read_sock(handle, usec, buf, len);
@@ -450,9 +1178,60 @@ int thread_server_write(unsigned char *buf, unsigned int len) {
   return 0;
 }
 
+// used by thread action
+int thread_server_receive_timeout(uint32_t usec, void **buf, unsigned int *len, void (**destructor)(void *buf), int *client) {
+  thread_arg_t *targ;
+  int r;
+
+  if (use_mailbox) {
+    r = thread_read_mailbox(thread_get_handle(), usec, buf, len, destructor, client);
+  } else {
+    *destructor = NULL;
+    r = thread_read_sock((thread_arg_t *)thread_get(local), usec, (unsigned char **)buf, len, client);
+  }
+
+  // a read that may block counts as a wakeup when it returns
+  if (usec && (targ = (thread_arg_t *)thread_get(local)) != NULL) {
+    __atomic_add_fetch(&targ->wakeups, 1, __ATOMIC_RELAXED);
+  }
+
+  // each read used to cost a zeroed MAX_DGRAM buffer
+  __atomic_add_fetch(&rbuf_stats.reads, 1, __ATOMIC_RELAXED);
+  if (r == 1) {
+    __atomic_add_fetch(&rbuf_stats.messages, 1, __ATOMIC_RELAXED);
+    if ((targ = (thread_arg_t *)thread_get(local)) != NULL) {
+      __atomic_add_fetch(&targ->msgs_in, 1, __ATOMIC_RELAXED);
+    }
+    if (*len < MAX_DGRAM) {
+      __atomic_add_fetch(&rbuf_stats.saved, MAX_DGRAM - *len, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_add_fetch(&rbuf_stats.saved, MAX_DGRAM, __ATOMIC_RELAXED);
+  }
+
+  return r;
+}
+
 // used by thread action
 int thread_server_read_timeout_from(uint32_t usec, unsigned char **buf, unsigned int *len, int *client) {
-  return thread_read_sock(thread_get_sock(), usec, buf, len, client);
+  void (*destructor)(void *buf);
+  void *p;
+  int r;
+
+  r = thread_server_receive_timeout(usec, &p, len, &destructor, client);
+  *buf = p;
+
+  if (r == 1 && p && destructor) {
+    // posted with its own destructor, but the caller will use xfree
+    if ((*buf = xmalloc_raw(*len)) != NULL) {
+      xmemcpy(*buf, p, *len);
+    } else {
+      r = -1;
+    }
+    destructor(p);
+  }
+
+  return r;
 }
 
 // used by thread action
@@ -465,83 +1244,161 @@ int thread_server_read(unsigned char **buf, unsigned int *len) {
   return thread_server_read_timeout(0, buf, len);
 }
 
+// bound on the bytes queued for the calling thread
+int thread_set_queue_limit(unsigned int bytes) {
+  if (use_mailbox) {
+    return mailbox_set_limit(thread_get_handle(), bytes);
+  }
+
+  debug(DEBUG_INFO, "THREAD", "queue limit is not supported on UDP channels");
+  return -1;
+}
+
 int thread_server_peek(void) {
+  if (use_mailbox) {
+    return mailbox_peek(thread_get_handle());
+  }
+
   return sys_peek(thread_get_sock());
 }
 
+// marks the thread of handle to finish, called with mutex locked
+static int thread_finish(thread_arg_t *targ, int handle) {
+  if (targ->port != handle) return 0;
+  __atomic_store_n(&targ->finish, 1, __ATOMIC_RELEASE);
+  thread_signal_fd(targ->endfd);
+
+  return 1;
+}
+
 int thread_end(char *tag, int handle) {
+  thread_arg_t *targ;
   uint8_t packet;
-  int r;
+  int i, r, found;
 
   debug(DEBUG_INFO, "THREAD", "closing thread with port %d", handle);
+
+  // the packet goes first, the thread may not be blocked on its channel
   packet = 0;
   r = thread_client_write(handle, &packet, 1);
 
+  if (mutex_lock(mutex) == 0) {
+    for (i = 1, found = 0; i < MAX_PS_THREADS && !found; i++) {
+      if (ps_targ[i]) found = thread_finish(ps_targ[i], handle);
+    }
+
+    // a job still queued, or not yet running, finds the flag when it starts
+    if (!found && mutex_lock(pool_mutex) == 0) {
+      for (targ = pool_head; targ && !found; targ = targ->next) {
+        found = thread_finish(targ, handle);
+      }
+      for (targ = starting_list; targ && !found; targ = targ->next) {
+        found = thread_finish(targ, handle);
+      }
+      mutex_unlock(pool_mutex);
+    }
+    mutex_unlock(mutex);
+  }
+
   return r;
 }
 
+void thread_set_wait_timeout(uint32_t us) {
+  wait_timeout = us;
+}
+
+// threads queued on the pool or about to start are also waited for;
+// called with mutex held, so no thread moves between the counters meanwhile
+static int thread_running(void) {
+  int n = num_threads;
+
+  if (mutex_lock(pool_mutex) == 0) {
+    n += pool_pending + num_starting;
+    mutex_unlock(pool_mutex);
+  }
+
+  return n;
+}
+
 void thread_wait_all(void) {
-  int i, n;
+  thread_exit_t *ex;
+  int64_t t0, dt;
+  int i, j, k, n;
 
-  for (i = 0, n = -1; i < 40; i++) {
-    if (mutex_lock(mutex) == 0) {
-      n = num_threads;
-      mutex_unlock(mutex);
+  if (mutex_lock(mutex) == 0) {
+    t0 = sys_get_clock();
+    n = thread_running();
+    // pool jobs that register while waiting add themselves, see thread_run
+    waiting = 1;
+    for (i = 1; i < MAX_PS_THREADS; i++) {
+      if (ps[i].tid) thread_exit_add(i);
     }
-    if (n <= 0) break;
-    debug(DEBUG_INFO, "THREAD", "waiting for %d thread(s)", n);
-    sys_usleep(500000);
-    n = -1;
-  }
 
-  if (n == 0) {
-    debug(DEBUG_INFO, "THREAD", "all threads finished");
-  } else if (n > 0) {
-    debug(DEBUG_ERROR, "THREAD", "%d thread(s) did not finish", n);
+    if (n > 0) {
+      debug(DEBUG_INFO, "THREAD", "waiting for %d thread(s)", n);
+    }
+
+    for (; n > 0;) {
+      dt = sys_get_clock() - t0;
+      if (dt >= wait_timeout) break;
+      cond_timedwait(exit_cond, mutex, wait_timeout - dt);
+      dt = sys_get_clock() - t0;
+
+      for (j = 0; j < wait_k; j++) {
+        if (wait_ex[j].dt == -1 && (ps[wait_ex[j].psi].tid == 0 || ps[wait_ex[j].psi].handle != wait_ex[j].handle)) {
+          wait_ex[j].dt = dt;
+        }
+      }
+      n = thread_running();
+    }
+    ex = wait_ex;
+    k = wait_k;
+    wait_ex = NULL;
+    wait_k = wait_size = 0;
+    waiting = 0;
+    mutex_unlock(mutex);
+
+    for (j = 0; j < k; j++) {
+      if (ex[j].dt >= 0) {
+        debug(DEBUG_INFO, "THREAD", "thread %s (%d) exited after %lld us", ex[j].name, ex[j].handle, ex[j].dt);
+      } else {
+        debug(DEBUG_ERROR, "THREAD", "thread %s (%d) still running", ex[j].name, ex[j].handle);
+      }
+      xfree(ex[j].name);
+    }
+    if (ex) xfree(ex);
+
+    dt = sys_get_clock() - t0;
+    if (n == 0) {
+      debug(DEBUG_INFO, "THREAD", "all threads finished in %lld us", dt);
+    } else {
+      debug(DEBUG_ERROR, "THREAD", "%d thread(s) did not finish in %lld us", n, dt);
+    }
   } else {
     debug(DEBUG_ERROR, "THREAD", "error waiting for threads");
   }
 }
 
+// may be called from a signal handler
 void thread_set_flags(unsigned int mask) {
-  if (mutex_lock(flags_mutex) == 0) {
-    flags |= mask;
-    mutex_unlock(flags_mutex);
+  __atomic_or_fetch(&flags, mask, __ATOMIC_RELEASE);
+  if (mask & FLAG_FINISH) {
+    thread_signal_fd(finish_fd);
   }
 }
 
 void thread_reset_flags(unsigned int mask) {
-  if (mutex_lock(flags_mutex) == 0) {
-    flags &= ~mask;
-    mutex_unlock(flags_mutex);
-  }
+  __atomic_and_fetch(&flags, ~mask, __ATOMIC_RELEASE);
 }
 
 void thread_set_status(int _status) {
-  if (mutex_lock(flags_mutex) == 0) {
-    status = _status;
-    mutex_unlock(flags_mutex);
-  }
+  __atomic_store_n(&status, _status, __ATOMIC_RELEASE);
 }
 
 int thread_get_status(void) {
-  int _status = 0;
-
-  if (mutex_lock(flags_mutex) == 0) {
-    _status = status;
-    mutex_unlock(flags_mutex);
-  }
-
-  return _status;
+  return __atomic_load_n(&status, __ATOMIC_ACQUIRE);
 }
 
 unsigned int thread_get_flags(unsigned int mask) {
-  unsigned int r = 0;
-
-  if (mutex_lock(flags_mutex) == 0) {
-    r = flags & mask;
-    mutex_unlock(flags_mutex);
-  }
-
-  return r;
+  return __atomic_load_n(&flags, __ATOMIC_ACQUIRE) & mask;
 }
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include "trace.h"
+#include "thread.h"
+#include "sys.h"
+#include "debug.h"
+
+// Each thread records events into its own buffer, so recording takes no lock
+// once the buffer is set up. A full buffer drops further events of its thread.
+// Buffers are kept after their thread exits, until the next trace_start(), so
+// that the trace can still be exported.
+
+#define TRACE_THREADS 64
+#define TRACE_EVENTS  65536
+#define TRACE_NAME    24
+
+typedef struct {
+  int64_t ts, value;
+  const char *cat;
+  char type;
+  char name[TRACE_NAME];
+} trace_rec_t;
+
+typedef struct {
+  int used, session;
+  uint32_t tid;
+  char name[32];
+  uint32_t count, max, dropped;
+  trace_rec_t *events;
+} trace_buffer_t;
+
+static trace_buffer_t buffers[TRACE_THREADS];
+static __thread trace_buffer_t *buffer __attribute__((tls_model("initial-exec")));
+static __thread int buffer_session __attribute__((tls_model("initial-exec")));
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static int session = 0;
+static int max_events = TRACE_EVENTS;
+static uint32_t lost = 0;
+
+int trace_active = 0;
+
+static void trace_release(void *value) {
+  trace_buffer_t *b = (trace_buffer_t *)value;
+
+  pthread_mutex_lock(&trace_mutex);
+  b->used = 0;
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_init(void) {
+  pthread_key_create(&trace_key, trace_release);
+}
+
+static trace_buffer_t *trace_buffer(void) {
+  trace_buffer_t *b;
+  trace_rec_t *events;
+  char name[32];
+  int i, s;
+
+  s = __atomic_load_n(&session, __ATOMIC_ACQUIRE);
+  if ((b = buffer) != NULL && buffer_session == s) {
+    return b;
+  }
+
+  pthread_once(&trace_once, trace_init);
+  thread_get_name(name, sizeof(name));
+
+  pthread_mutex_lock(&trace_mutex);
+
+  if (b == NULL) {
+    // buffers of exited threads are kept until the session changes
+    for (i = 0; i < TRACE_THREADS; i++) {
+      if (!buffers[i].used && buffers[i].session != s) break;
+    }
+    if (i == TRACE_THREADS) {
+      pthread_mutex_unlock(&trace_mutex);
+      return NULL;
+    }
+    b = &buffers[i];
+    b->used = 1;
+    pthread_setspecific(trace_key, b);
+    buffer = b;
+  }
+
+  if (b->max != max_events) {
+    if ((events = realloc(b->events, max_events * sizeof(trace_rec_t))) == NULL) {
+      pthread_mutex_unlock(&trace_mutex);
+      return NULL;
+    }
+    b->events = events;
+    b->max = max_events;
+  }
+
+  b->tid = sys_get_tid();
+  strncpy(b->name, name, sizeof(b->name)-1);
+  b->dropped = 0;
+  __atomic_store_n(&b->count, 0, __ATOMIC_RELEASE);
+  b->session = s;
+  buffer_session = s;
+
+  pthread_mutex_unlock(&trace_mutex);
+
+  return b;
+}
+
+void trace_event(int type, const char *cat, const char *name, int64_t ts, int64_t value) {
+  trace_buffer_t *b;
+  trace_rec_t *ev;
+  uint32_t n;
+
+  if ((b = trace_buffer()) == NULL) {
+    __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  n = b->count;
+  if (n == b->max) {
+    b->dropped++;
+    return;
+  }
+
+  ev = &b->events[n];
+  ev->ts = ts ? ts : sys_get_clock();
+  ev->value = value;
+  ev->cat = cat;
+  ev->type = type;
+  strncpy(ev->name, name ? name : "", TRACE_NAME-1);
+  ev->name[TRACE_NAME-1] = 0;
+
+  __atomic_store_n(&b->count, n + 1, __ATOMIC_RELEASE);
+}
+
+int trace_start(int events) {
+  pthread_mutex_lock(&trace_mutex);
+  max_events = events > 0 ? events : TRACE_EVENTS;
+  lost = 0;
+  __atomic_add_fetch(&session, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_mutex);
+  __atomic_store_n(&trace_active, 1, __ATOMIC_RELEASE);
+  debug(DEBUG_INFO, "TRACE", "trace started (%d events per thread)", max_events);
+
+  return 0;
+}
+
+int trace_stop(void) {
+  __atomic_store_n(&trace_active, 0, __ATOMIC_RELEASE);
+  debug(DEBUG_INFO, "TRACE", "trace stopped");
+
+  return 0;
+}
+
+static void trace_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', f);
+      fputc(*s, f);
+    } else if ((uint8_t)*s < 32) {
+      fprintf(f, "\\u%04x", (uint8_t)*s);
+    } else {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+}
+
+// Writes the events of the current session in the Chrome trace event format,
+// which chrome://tracing and Perfetto load directly.
+int trace_export(char *filename) {
+  trace_buffer_t *b;
+  trace_rec_t *ev;
+  uint32_t pid, i, n, total, dropped;
+  int j, first;
+  FILE *f;
+
+  if ((f = fopen(filename, "w")) == NULL) {
+    debug_errno("TRACE", "fopen \"%s\"", filename);
+    return -1;
+  }
+
+  pid = sys_get_pid();
+  fprintf(f, "{\"traceEvents\":[\n");
+  first = 1;
+  total = 0;
+  dropped = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&trace_mutex);
+
+  for (j = 0; j < TRACE_THREADS; j++) {
+    b = &buffers[j];
+    if (b->session != session || b->events == NULL) continue;
+
+    fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n", pid, b->tid);
+    trace_string(f, b->name);
+    fprintf(f, "}}");
+    first = 0;
+
+    n = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+      ev = &b->events[i];
+      fprintf(f, ",\n{\"ph\":\"%c\",\"cat\":", ev->type);
+      trace_string(f, ev->cat ? ev->cat : "");
+      fprintf(f, ",\"name\":");
+      trace_string(f, ev->name);
+      fprintf(f, ",\"ts\":%lld,\"pid\":%u,\"tid\":%u", (long long)ev->ts, pid, b->tid);
+      switch (ev->type) {
+        case TRACE_COMPLETE:
+          fprintf(f, ",\"dur\":%lld", (long long)ev->value);
+          break;
+        case TRACE_COUNTER:
+          fprintf(f, ",\"args\":{\"value\":%lld}", (long long)ev->value);
+          break;
+      }
+      fprintf(f, "}");
+    }
+    total += n;
+    dropped += b->dropped;
+  }
+
+  pthread_mutex_unlock(&trace_mutex);
+
+  fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(f);
+  debug(DEBUG_INFO, "TRACE", "exported %u events to \"%s\" (%u dropped)", total, filename, dropped);
+
+  return 0;
+}
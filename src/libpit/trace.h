@@ -0,0 +1,36 @@
+#ifndef PIT_TRACE_H
+#define PIT_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// event types, as named by the Chrome trace format
+#define TRACE_BEGIN    'B'
+#define TRACE_END      'E'
+#define TRACE_COMPLETE 'X'
+#define TRACE_COUNTER  'C'
+
+// lock waits shorter than this (in us) are not recorded
+#define TRACE_LOCK_WAIT 10
+
+extern int trace_active;
+
+int trace_start(int events);
+
+int trace_stop(void);
+
+int trace_export(char *filename);
+
+void trace_event(int type, const char *cat, const char *name, int64_t ts, int64_t value);
+
+#define trace_begin(cat, name)          do { if (trace_active) trace_event(TRACE_BEGIN, cat, name, 0, 0); } while (0)
+#define trace_end(cat, name)            do { if (trace_active) trace_event(TRACE_END, cat, name, 0, 0); } while (0)
+#define trace_span(cat, name, ts, dur)  do { if (trace_active) trace_event(TRACE_COMPLETE, cat, name, ts, dur); } while (0)
+#define trace_counter(cat, name, value) do { if (trace_active) trace_event(TRACE_COUNTER, cat, name, 0, value); } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
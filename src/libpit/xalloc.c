@@ -1,16 +1,692 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <pthread.h>
 
 #include "xalloc.h"
+#include "sys.h"
 #include "debug.h"
 
-void *xmalloc_debug(const char *file, const char *func, int line, size_t size) {
-  void *ptr = malloc(size);
+// Allocations up to XALLOC_MAX_SIZE bytes come from size classes of powers
+// of two, carved from slabs of XALLOC_SLAB bytes aligned to their size. The
+// slab of a block is found by masking its address, and a registry of slab
+// addresses tells pool blocks apart from blocks that came from malloc.
+// Larger allocations go to malloc, so that rounding up to a power of two
+// does not waste more than XALLOC_MAX_SIZE / 2 bytes per block.
+//
+// Each thread keeps a cache of free blocks per class, so most allocations
+// and frees take no lock. A cache above XALLOC_CACHE bytes gives half of its
+// blocks back to the arena. Each slab keeps its own free list, and a slab
+// whose blocks are all back in the arena is released, except for one empty
+// slab kept per class.
+//
+// Every block is charged to its allocation site (file and line) and to a
+// subsystem named after the source file. Pool blocks keep the site index in
+// a table at the start of their slab. Larger blocks are kept in a hash table
+// whose buckets share XALLOC_LARGE_LOCKS mutexes, so that threads passing
+// video frames around seldom wait for each other.
+// The counters are kept per thread and only summed when they are read, so
+// charging a block takes no atomic operation. The peak is measured on the
+// sums, that is, when statistics are read.
+
+#define XALLOC_SLAB      (1 << 20)
+#define XALLOC_MIN_SHIFT 4
+#define XALLOC_CLASSES   12
+#define XALLOC_MAX_SIZE  (1 << (XALLOC_MIN_SHIFT + XALLOC_CLASSES - 1))
+#define XALLOC_HEADER    128
+#define XALLOC_CACHE     (256 * 1024)
+#define XALLOC_BATCH     32
+#define XALLOC_MAX_SLABS 16384
+#define XALLOC_SITES     8192
+#define XALLOC_SYSTEMS   128
+#define XALLOC_LARGE     1024
+#define XALLOC_LARGE_LOCKS 64
+#define XALLOC_REPORT    20
+
+// registry entries that were removed
+#define XALLOC_DELETED   1
+
+typedef struct xblock_t {
+  struct xblock_t *next;
+} xblock_t;
+
+typedef struct xslab_t {
+  struct xarena_t *arena;
+  int cls, nblocks, carved, used;
+  uint32_t start;
+  uint16_t *sites;
+  xblock_t *free;
+  struct xslab_t *prev, *next;    // all slabs of the arena
+  struct xslab_t *pprev, *pnext;  // slabs of the class with blocks to give
+} xslab_t;
+
+typedef struct {
+  xslab_t *partial;
+  int empty;
+} xclass_t;
+
+typedef struct xarena_t {
+  char name[16];
+  pthread_mutex_t mutex;
+  xclass_t cls[XALLOC_CLASSES];
+  xslab_t *slabs;
+} xarena_t;
+
+typedef struct {
+  xblock_t *free;
+  int count;
+} xcache_t;
+
+typedef struct {
+  const char *file;
+  const char *func;
+  int line, sys;
+} xsite_t;
+
+typedef struct {
+  char name[16];
+  int64_t peak;
+  uint64_t last_allocs;
+  int64_t last_t;
+  double rate;
+} xsys_t;
+
+// counters of one thread, written only by that thread
+typedef struct xcount_t {
+  struct {
+    int64_t live, count;
+  } sites[XALLOC_SITES];
+  struct {
+    int64_t live;
+    uint64_t allocs, frees, bytes;
+  } systems[XALLOC_SYSTEMS];
+  struct xcount_t *next;
+} xcount_t;
+
+// read by other threads while the owner writes, but never written by two
+#define XCOUNT_ADD(c, n) __atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+
+typedef struct xlarge_t {
+  void *ptr;
+  size_t size;
+  int site;
+  struct xlarge_t *next;
+} xlarge_t;
+
+static xarena_t default_arena = { "default", PTHREAD_MUTEX_INITIALIZER };
+
+static uintptr_t slab_table[XALLOC_MAX_SLABS];
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// libpit is linked by the executable, so the initial exec model applies
+static __thread xcache_t cache[XALLOC_CLASSES] __attribute__((tls_model("initial-exec")));
+static __thread int cache_registered __attribute__((tls_model("initial-exec")));
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// counters of live threads; retired, protected by count_mutex, has the
+// counters of threads that exited
+static __thread xcount_t *counts __attribute__((tls_model("initial-exec")));
+static __thread int counts_exited __attribute__((tls_model("initial-exec")));
+static xcount_t *count_list, retired;
+static pthread_key_t count_key;
+static pthread_once_t count_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// site 0 and subsystem 0 collect what does not fit in the tables
+static xsite_t sites[XALLOC_SITES];
+static xsys_t systems[XALLOC_SYSTEMS] = { { "OTHER" } };
+static xsys_t total = { "TOTAL" };
+static int num_systems = 1;
+static pthread_mutex_t site_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static xlarge_t *large[XALLOC_LARGE];
+static pthread_mutex_t large_mutex[XALLOC_LARGE_LOCKS];
+static pthread_once_t large_once = PTHREAD_ONCE_INIT;
+
+static int xsize_class(size_t size) {
+  if (size > XALLOC_MAX_SIZE) return -1;
+  if (size <= (1 << XALLOC_MIN_SHIFT)) return 0;
+
+  // number of bits of size-1, minus the bits of the smallest class
+  return (int)(sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long)(size - 1)) - XALLOC_MIN_SHIFT;
+}
+
+static size_t xclass_size(int c) {
+  return (size_t)1 << (XALLOC_MIN_SHIFT + c);
+}
+
+// the subsystem of a site is the base name of its source file in upper case
+static int xsys_get(const char *file) {
+  char name[16];
+  const char *p;
+  int i;
+
+  if ((p = strrchr(file, '/')) != NULL) file = p + 1;
+  for (i = 0; file[i] && file[i] != '.' && i < (int)sizeof(name)-1; i++) {
+    name[i] = toupper((unsigned char)file[i]);
+  }
+  name[i] = 0;
+
+  for (i = 1; i < num_systems; i++) {
+    if (!strcmp(systems[i].name, name)) return i;
+  }
+  if (num_systems == XALLOC_SYSTEMS) return 0;
+  strcpy(systems[num_systems].name, name);
+
+  return num_systems++;
+}
+
+static int xsite_hash(const char *file, int line) {
+  return (int)((((uintptr_t)file >> 3) * 31 + line) * 2654435761u % (XALLOC_SITES - 1)) + 1;
+}
+
+static int xsite_get(const char *file, const char *func, int line) {
+  const char *f;
+  int i, n;
+
+  for (i = xsite_hash(file, line), n = 1; n < XALLOC_SITES; n++) {
+    f = __atomic_load_n(&sites[i].file, __ATOMIC_ACQUIRE);
+    if (f == file && sites[i].line == line) return i;
+
+    if (f == NULL) {
+      pthread_mutex_lock(&site_mutex);
+      if ((f = sites[i].file) == NULL) {
+        sites[i].func = func;
+        sites[i].line = line;
+        sites[i].sys = xsys_get(file);
+        __atomic_store_n(&sites[i].file, file, __ATOMIC_RELEASE);
+        f = file;
+      }
+      pthread_mutex_unlock(&site_mutex);
+      // another thread may have taken the entry for a different site
+      if (f == file && sites[i].line == line) return i;
+    }
+
+    i = (i % (XALLOC_SITES - 1)) + 1;
+  }
+
+  return 0;
+}
+
+static void xcount_add(xcount_t *dst, xcount_t *src) {
+  int i;
+
+  for (i = 0; i < XALLOC_SITES; i++) {
+    dst->sites[i].live += __atomic_load_n(&src->sites[i].live, __ATOMIC_RELAXED);
+    dst->sites[i].count += __atomic_load_n(&src->sites[i].count, __ATOMIC_RELAXED);
+  }
+  for (i = 0; i < XALLOC_SYSTEMS; i++) {
+    dst->systems[i].live += __atomic_load_n(&src->systems[i].live, __ATOMIC_RELAXED);
+    dst->systems[i].allocs += __atomic_load_n(&src->systems[i].allocs, __ATOMIC_RELAXED);
+    dst->systems[i].frees += __atomic_load_n(&src->systems[i].frees, __ATOMIC_RELAXED);
+    dst->systems[i].bytes += __atomic_load_n(&src->systems[i].bytes, __ATOMIC_RELAXED);
+  }
+}
+
+// the counters of an exiting thread are added to retired
+static void xcount_destructor(void *value) {
+  xcount_t *c = (xcount_t *)value, **p;
+
+  pthread_mutex_lock(&count_mutex);
+  for (p = &count_list; *p; p = &(*p)->next) {
+    if (*p == c) {
+      *p = c->next;
+      break;
+    }
+  }
+  xcount_add(&retired, c);
+  pthread_mutex_unlock(&count_mutex);
+  free(c);
+  counts = NULL;
+  counts_exited = 1;
+}
+
+static void xcount_init(void) {
+  pthread_key_create(&count_key, xcount_destructor);
+}
+
+static xcount_t *xcount_get(void) {
+  xcount_t *c;
+
+  if (counts || counts_exited) return counts;
+
+  // allocated with calloc, xalloc would charge it to itself
+  pthread_once(&count_once, xcount_init);
+  if ((c = calloc(1, sizeof(xcount_t))) != NULL) {
+    pthread_mutex_lock(&count_mutex);
+    c->next = count_list;
+    count_list = c;
+    pthread_mutex_unlock(&count_mutex);
+    pthread_setspecific(count_key, c);
+    counts = c;
+  }
+
+  return c;
+}
+
+// returns the counters of all threads added up, released with free
+static xcount_t *xcount_sum(void) {
+  xcount_t *sum, *c;
+
+  if ((sum = calloc(1, sizeof(xcount_t))) != NULL) {
+    pthread_mutex_lock(&count_mutex);
+    xcount_add(sum, &retired);
+    for (c = count_list; c; c = c->next) {
+      xcount_add(sum, c);
+    }
+    pthread_mutex_unlock(&count_mutex);
+  }
+
+  return sum;
+}
+
+static void xaccount(int site, int64_t bytes) {
+  int sys = sites[site].sys;
+  xcount_t *c;
+
+  // an exiting thread, or one with no memory for its counters, uses retired
+  if ((c = xcount_get()) == NULL) {
+    pthread_mutex_lock(&count_mutex);
+    c = &retired;
+  }
+
+  XCOUNT_ADD(c->sites[site].live, bytes);
+  XCOUNT_ADD(c->sites[site].count, bytes > 0 ? 1 : -1);
+  XCOUNT_ADD(c->systems[sys].live, bytes);
+  if (bytes > 0) {
+    XCOUNT_ADD(c->systems[sys].allocs, 1);
+    XCOUNT_ADD(c->systems[sys].bytes, bytes);
+  } else {
+    XCOUNT_ADD(c->systems[sys].frees, 1);
+  }
+
+  if (c == &retired) {
+    pthread_mutex_unlock(&count_mutex);
+  }
+}
+
+static int xlarge_hash(void *ptr) {
+  return (int)(((uintptr_t)ptr >> 4) * 2654435761u % XALLOC_LARGE);
+}
+
+static void xlarge_init(void) {
+  int i;
+
+  for (i = 0; i < XALLOC_LARGE_LOCKS; i++) {
+    pthread_mutex_init(&large_mutex[i], NULL);
+  }
+}
+
+static void *xlarge_alloc(size_t size, int site) {
+  xlarge_t *l;
+  void *ptr;
+  int h;
+
+  if ((l = malloc(sizeof(xlarge_t))) == NULL) {
+    return NULL;
+  }
+
+  if ((ptr = malloc(size)) == NULL) {
+    free(l);
+    return NULL;
+  }
+
+  pthread_once(&large_once, xlarge_init);
+  l->ptr = ptr;
+  l->size = size;
+  l->site = site;
+  h = xlarge_hash(ptr);
+
+  pthread_mutex_lock(&large_mutex[h % XALLOC_LARGE_LOCKS]);
+  l->next = large[h];
+  large[h] = l;
+  pthread_mutex_unlock(&large_mutex[h % XALLOC_LARGE_LOCKS]);
+  xaccount(site, size);
+
+  return ptr;
+}
+
+// returns the size of a large block, or 0 if the block is not known
+static size_t xlarge_size(void *ptr) {
+  xlarge_t *l;
+  size_t size = 0;
+  int h;
+
+  pthread_once(&large_once, xlarge_init);
+  h = xlarge_hash(ptr);
+  pthread_mutex_lock(&large_mutex[h % XALLOC_LARGE_LOCKS]);
+  for (l = large[h]; l; l = l->next) {
+    if (l->ptr == ptr) {
+      size = l->size;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&large_mutex[h % XALLOC_LARGE_LOCKS]);
+
+  return size;
+}
+
+static int xlarge_free(void *ptr) {
+  xlarge_t *l, *prev;
+  int h;
+
+  pthread_once(&large_once, xlarge_init);
+  h = xlarge_hash(ptr);
+  pthread_mutex_lock(&large_mutex[h % XALLOC_LARGE_LOCKS]);
+  for (l = large[h], prev = NULL; l; prev = l, l = l->next) {
+    if (l->ptr == ptr) {
+      if (prev) prev->next = l->next;
+      else large[h] = l->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&large_mutex[h % XALLOC_LARGE_LOCKS]);
+
+  if (l == NULL) {
+    return -1;
+  }
+
+  xaccount(l->site, -(int64_t)l->size);
+  free(l->ptr);
+  free(l);
+
+  return 0;
+}
+
+static int xslab_hash(uintptr_t base) {
+  return (int)(((base / XALLOC_SLAB) * 2654435761u) % XALLOC_MAX_SLABS);
+}
+
+// returns the slab of a pool block, or NULL if the block came from malloc
+static xslab_t *xslab_find(void *ptr) {
+  uintptr_t base, b;
+  int i, n;
+
+  base = (uintptr_t)ptr & ~((uintptr_t)XALLOC_SLAB - 1);
+  for (i = xslab_hash(base), n = 0; n < XALLOC_MAX_SLABS; i = (i + 1) % XALLOC_MAX_SLABS, n++) {
+    b = __atomic_load_n(&slab_table[i], __ATOMIC_ACQUIRE);
+    if (b == base) return (xslab_t *)base;
+    if (b == 0) break;
+  }
+
+  return NULL;
+}
+
+static int xslab_register(uintptr_t base, int add) {
+  uintptr_t b;
+  int i, n, r = -1;
+
+  pthread_mutex_lock(&slab_mutex);
+  for (i = xslab_hash(base), n = 0; n < XALLOC_MAX_SLABS; i = (i + 1) % XALLOC_MAX_SLABS, n++) {
+    b = slab_table[i];
+    if (add && (b == 0 || b == XALLOC_DELETED)) {
+      __atomic_store_n(&slab_table[i], base, __ATOMIC_RELEASE);
+      r = 0;
+      break;
+    }
+    if (!add && b == base) {
+      __atomic_store_n(&slab_table[i], XALLOC_DELETED, __ATOMIC_RELEASE);
+      // entries removed at the end of a probe chain are not needed to find others
+      while (slab_table[(i + 1) % XALLOC_MAX_SLABS] == 0 && slab_table[i] == XALLOC_DELETED) {
+        __atomic_store_n(&slab_table[i], 0, __ATOMIC_RELEASE);
+        i = (i + XALLOC_MAX_SLABS - 1) % XALLOC_MAX_SLABS;
+      }
+      r = 0;
+      break;
+    }
+    if (b == 0) break;
+  }
+  pthread_mutex_unlock(&slab_mutex);
+
+  return r;
+}
+
+static xslab_t *xslab_new(xarena_t *arena, int c) {
+  xslab_t *slab;
+  size_t size;
+  void *p;
+
+  if (posix_memalign(&p, XALLOC_SLAB, XALLOC_SLAB) != 0) {
+    return NULL;
+  }
+
+  slab = (xslab_t *)p;
+  if (xslab_register((uintptr_t)slab, 1) != 0) {
+    free(p);
+    return NULL;
+  }
+
+  // the site table goes between the header and the first block
+  size = xclass_size(c);
+  slab->arena = arena;
+  slab->cls = c;
+  slab->nblocks = (XALLOC_SLAB - XALLOC_HEADER - 16) / (size + sizeof(uint16_t));
+  slab->carved = slab->used = 0;
+  slab->sites = (uint16_t *)((uint8_t *)slab + XALLOC_HEADER);
+  slab->start = (XALLOC_HEADER + slab->nblocks * sizeof(uint16_t) + 15) & ~15;
+  slab->free = NULL;
+  slab->prev = NULL;
+  slab->next = arena->slabs;
+  if (slab->next) slab->next->prev = slab;
+  arena->slabs = slab;
+  slab->pprev = NULL;
+  slab->pnext = arena->cls[c].partial;
+  if (slab->pnext) slab->pnext->pprev = slab;
+  arena->cls[c].partial = slab;
+  arena->cls[c].empty++;
+
+  return slab;
+}
+
+static void xslab_unlink_partial(xarena_t *arena, xslab_t *slab) {
+  if (slab->pprev) slab->pprev->pnext = slab->pnext;
+  else arena->cls[slab->cls].partial = slab->pnext;
+  if (slab->pnext) slab->pnext->pprev = slab->pprev;
+  slab->pprev = slab->pnext = NULL;
+}
+
+// releases a slab with no block in use, called with the arena locked
+static void xslab_release(xarena_t *arena, xslab_t *slab) {
+  xslab_unlink_partial(arena, slab);
+  if (slab->prev) slab->prev->next = slab->next;
+  else arena->slabs = slab->next;
+  if (slab->next) slab->next->prev = slab->prev;
+  xslab_register((uintptr_t)slab, 0);
+  free(slab);
+}
+
+static int xslab_index(xslab_t *slab, void *ptr) {
+  return (int)(((uint8_t *)ptr - (uint8_t *)slab - slab->start) >> (XALLOC_MIN_SHIFT + slab->cls));
+}
+
+// takes up to n blocks of class c from the arena, called with the arena locked
+static xblock_t *xarena_take(xarena_t *arena, int c, int n, int *taken) {
+  xclass_t *cls = &arena->cls[c];
+  xblock_t *list, *b;
+  xslab_t *slab;
+  size_t size;
+  int i;
+
+  size = xclass_size(c);
+  list = NULL;
+
+  for (i = 0; i < n; i++) {
+    if ((slab = cls->partial) == NULL && (slab = xslab_new(arena, c)) == NULL) break;
+    if (slab->free) {
+      b = slab->free;
+      slab->free = b->next;
+    } else {
+      b = (xblock_t *)((uint8_t *)slab + slab->start + slab->carved * size);
+      slab->carved++;
+    }
+    if (slab->used++ == 0) cls->empty--;
+    if (slab->free == NULL && slab->carved == slab->nblocks) {
+      xslab_unlink_partial(arena, slab);
+    }
+    b->next = list;
+    list = b;
+  }
+  *taken = i;
+
+  return list;
+}
+
+// gives back the blocks from first to last, all of class c
+static void xarena_give(xarena_t *arena, int c, xblock_t *first, xblock_t *last) {
+  xclass_t *cls = &arena->cls[c];
+  xblock_t *b, *next;
+  xslab_t *slab;
+
+  pthread_mutex_lock(&arena->mutex);
+  for (b = first;; b = next) {
+    next = b->next;
+    slab = (xslab_t *)((uintptr_t)b & ~((uintptr_t)XALLOC_SLAB - 1));
+    if (slab->free == NULL && slab->carved == slab->nblocks) {
+      // the slab was full, it has a block to give again
+      slab->pprev = NULL;
+      slab->pnext = cls->partial;
+      if (slab->pnext) slab->pnext->pprev = slab;
+      cls->partial = slab;
+    }
+    b->next = slab->free;
+    slab->free = b;
+    if (--slab->used == 0) {
+      if (cls->empty) xslab_release(arena, slab);
+      else cls->empty++;
+    }
+    if (b == last) break;
+  }
+  pthread_mutex_unlock(&arena->mutex);
+}
+
+static void xcache_flush(xcache_t *cc, int c, int keep) {
+  xblock_t *first, *last;
+
+  if (cc->count <= keep) return;
+  for (first = last = cc->free; cc->count > keep + 1; cc->count--) {
+    last = last->next;
+  }
+  cc->free = last->next;
+  cc->count--;
+  xarena_give(&default_arena, c, first, last);
+}
+
+// gives the blocks cached by an exiting thread back to the default arena
+static void xcache_destructor(void *value) {
+  xcache_t *cc = (xcache_t *)value;
+  int c;
+
+  for (c = 0; c < XALLOC_CLASSES; c++) {
+    xcache_flush(&cc[c], c, 0);
+  }
+  // later frees in this thread go straight to the arena
+  cache_registered = 0;
+}
+
+static void xcache_init(void) {
+  pthread_key_create(&cache_key, xcache_destructor);
+}
+
+static xblock_t *xpool_take(xarena_t *arena, int c) {
+  xcache_t *cc;
+  xblock_t *b;
+  int n;
+
+  if (!cache_registered) {
+    pthread_once(&cache_once, xcache_init);
+    pthread_setspecific(cache_key, cache);
+    cache_registered = 1;
+  }
+
+  cc = &cache[c];
+  if (cc->free == NULL) {
+    n = XALLOC_CACHE / xclass_size(c);
+    if (n > XALLOC_BATCH) n = XALLOC_BATCH;
+    if (n < 1) n = 1;
+    pthread_mutex_lock(&arena->mutex);
+    cc->free = xarena_take(arena, c, n, &n);
+    pthread_mutex_unlock(&arena->mutex);
+    cc->count = n;
+    if (cc->free == NULL) return NULL;
+  }
+
+  b = cc->free;
+  cc->free = b->next;
+  cc->count--;
+
+  return b;
+}
+
+static void *xpool_alloc(xarena_t *arena, size_t size, int site) {
+  xslab_t *slab;
+  xblock_t *b;
+  int c;
+
+  if ((c = xsize_class(size)) == -1) {
+    return xlarge_alloc(size, site);
+  }
+
+  if ((b = xpool_take(arena, c)) != NULL) {
+    slab = (xslab_t *)((uintptr_t)b & ~((uintptr_t)XALLOC_SLAB - 1));
+    slab->sites[xslab_index(slab, b)] = site;
+    xaccount(site, xclass_size(c));
+  }
+
+  return b;
+}
+
+static void xpool_free(void *ptr) {
+  xslab_t *slab;
+  xcache_t *cc;
+  xblock_t *b;
+  int c, max;
+
+  if ((slab = xslab_find(ptr)) == NULL) {
+    // not a pool block, and not a large block either if it came from malloc
+    if (xlarge_free(ptr) == -1) free(ptr);
+    return;
+  }
+
+  b = (xblock_t *)ptr;
+  c = slab->cls;
+  xaccount(slab->sites[xslab_index(slab, b)], -(int64_t)xclass_size(c));
+
+  if (!cache_registered) {
+    xarena_give(slab->arena, c, b, b);
+    return;
+  }
+
+  cc = &cache[c];
+  b->next = cc->free;
+  cc->free = b;
+  cc->count++;
+
+  max = XALLOC_CACHE / xclass_size(c);
+  if (max < 2) max = 2;
+  if (cc->count > max) {
+    xcache_flush(cc, c, max / 2);
+  }
+}
+
+// usable size of a block, 0 if it did not come from xalloc
+static size_t xpool_size(void *ptr) {
+  xslab_t *slab;
+
+  return (slab = xslab_find(ptr)) != NULL ? xclass_size(slab->cls) : xlarge_size(ptr);
+}
+
+static void *xalloc_new(const char *file, const char *func, int line, size_t size) {
+  void *ptr = xpool_alloc(&default_arena, size, xsite_get(file, func, line));
 
   if (ptr) {
-    debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", ptr, size);
-    memset(ptr, 0, size);
+    debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", ptr, size);
   } else {
     debug_full(file, func, line, DEBUG_ERROR, "MEM", "memory new error %d", size);
   }
@@ -18,6 +694,20 @@ void *xmalloc_debug(const char *file, const char *func, int line, size_t size) {
   return ptr;
 }
 
+void *xmalloc_raw_debug(const char *file, const char *func, int line, size_t size) {
+  return xalloc_new(file, func, line, size);
+}
+
+void *xmalloc_debug(const char *file, const char *func, int line, size_t size) {
+  void *ptr = xalloc_new(file, func, line, size);
+
+  if (ptr) {
+    memset(ptr, 0, size);
+  }
+
+  return ptr;
+}
+
 void *xcalloc_debug(const char *file, const char *func, int line, size_t nmemb, size_t size) {
   size_t len = nmemb * size;
   return xmalloc_debug(file, func, line, len);
@@ -25,17 +715,34 @@ void *xcalloc_debug(const char *file, const char *func, int line, size_t nmemb,
 
 void *xrealloc_debug(const char *file, const char *func, int line, void *ptr, size_t size) {
   void *ptr2 = NULL;
+  size_t old;
 
-  ptr2 = realloc(ptr, size);
+  if (ptr && (old = xpool_size(ptr)) > 0) {
+    if (size && size <= old && xslab_find(ptr)) {
+      // the pool block is already big enough
+      ptr2 = ptr;
+    } else if (size) {
+      if ((ptr2 = xpool_alloc(&default_arena, size, xsite_get(file, func, line))) != NULL) {
+        memcpy(ptr2, ptr, old < size ? old : size);
+        xpool_free(ptr);
+      }
+    } else {
+      xpool_free(ptr);
+    }
+  } else if (ptr == NULL) {
+    ptr2 = size ? xpool_alloc(&default_arena, size, xsite_get(file, func, line)) : NULL;
+  } else {
+    ptr2 = realloc(ptr, size);
+  }
 
   if (ptr2) {
-    debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory free %p", ptr);
-    debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", ptr2, size);
+    debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory free %p", ptr);
+    debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", ptr2, size);
   } else {
     if (size) {
       debug_full(file, func, line, DEBUG_ERROR, "MEM", "memory new error %d", size);
     } else {
-      debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", ptr2, size);
+      debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", ptr2, size);
     }
   }
 
@@ -44,8 +751,8 @@ void *xrealloc_debug(const char *file, const char *func, int line, void *ptr, si
 
 void xfree_debug(const char *file, const char *func, int line, void *ptr) {
   if (ptr) {
-    debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory free %p", ptr);
-    free(ptr);
+    debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory free %p", ptr);
+    xpool_free(ptr);
   } else {
     debug_full(file, func, line, DEBUG_ERROR, "MEM", "memory free null");
   }
@@ -55,10 +762,12 @@ char *xstrdup_debug(const char *file, const char *func, int line, const char *s)
   char *r = NULL;
 
   if (s) {
-    r = strdup(s);
+    if ((r = xpool_alloc(&default_arena, strlen(s)+1, xsite_get(file, func, line))) != NULL) {
+      strcpy(r, s);
+    }
 
     if (r) {
-      debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", r, strlen(s)+1);
+      debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory new %p %d", r, strlen(s)+1);
     } else {
       debug_full(file, func, line, DEBUG_ERROR, "MEM", "memory new error %d", strlen(s)+1);
     }
@@ -69,11 +778,139 @@ char *xstrdup_debug(const char *file, const char *func, int line, const char *s)
   return r;
 }
 
+// dst has the summed counters, sys keeps the peak and the rate between calls
+static void xsys_copy(xalloc_stats_t *dst, xsys_t *sys, int64_t now) {
+  strncpy(dst->name, sys->name, sizeof(dst->name)-1);
+  if (dst->live > sys->peak) sys->peak = dst->live;
+  dst->peak = sys->peak;
+
+  // the rate is measured over at least one second between calls
+  if (now - sys->last_t >= 1000000) {
+    if (sys->last_t) {
+      sys->rate = (double)(dst->allocs - sys->last_allocs) * 1000000.0 / (now - sys->last_t);
+    }
+    sys->last_allocs = dst->allocs;
+    sys->last_t = now;
+  }
+  dst->rate = sys->rate;
+}
+
+// The first entry is the process total, the others are the subsystems that
+// allocated memory. The array is released with xfree.
+xalloc_stats_t *xalloc_stats(int *n) {
+  xalloc_stats_t *st;
+  xcount_t *sum;
+  int64_t now;
+  int i, k, num;
+
+  // allocated with calloc, so that reading the counters does not change them
+  if ((st = calloc(XALLOC_SYSTEMS + 1, sizeof(xalloc_stats_t))) == NULL) {
+    *n = 0;
+    return NULL;
+  }
+
+  if ((sum = xcount_sum()) == NULL) {
+    free(st);
+    *n = 0;
+    return NULL;
+  }
+
+  now = sys_get_clock();
+  pthread_mutex_lock(&site_mutex);
+  num = num_systems;
+  for (i = 0, k = 1; i < num; i++) {
+    st[0].live += sum->systems[i].live;
+    st[0].allocs += sum->systems[i].allocs;
+    st[0].frees += sum->systems[i].frees;
+    st[0].bytes += sum->systems[i].bytes;
+    if (sum->systems[i].allocs) {
+      st[k].live = sum->systems[i].live;
+      st[k].allocs = sum->systems[i].allocs;
+      st[k].frees = sum->systems[i].frees;
+      st[k].bytes = sum->systems[i].bytes;
+      xsys_copy(&st[k++], &systems[i], now);
+    }
+  }
+  xsys_copy(&st[0], &total, now);
+  pthread_mutex_unlock(&site_mutex);
+  free(sum);
+  *n = k;
+
+  return st;
+}
+
+static int xsite_cmp(const void *a, const void *b) {
+  const xalloc_site_t *s1 = (const xalloc_site_t *)a;
+  const xalloc_site_t *s2 = (const xalloc_site_t *)b;
+
+  return s1->live < s2->live ? 1 : (s1->live > s2->live ? -1 : 0);
+}
+
+// Sites with blocks still allocated, most bytes first. The array is
+// released with xfree.
+xalloc_site_t *xalloc_sites(int *n) {
+  xalloc_site_t *st;
+  xcount_t *sum;
+  int i, k;
+
+  if ((st = calloc(XALLOC_SITES, sizeof(xalloc_site_t))) == NULL) {
+    *n = 0;
+    return NULL;
+  }
+
+  if ((sum = xcount_sum()) == NULL) {
+    free(st);
+    *n = 0;
+    return NULL;
+  }
+
+  for (i = 0, k = 0; i < XALLOC_SITES; i++) {
+    if (sum->sites[i].count > 0 && (i == 0 || __atomic_load_n(&sites[i].file, __ATOMIC_ACQUIRE))) {
+      st[k].file = i ? sites[i].file : "?";
+      st[k].func = i ? sites[i].func : "?";
+      st[k].line = sites[i].line;
+      strncpy(st[k].name, systems[sites[i].sys].name, sizeof(st[k].name)-1);
+      st[k].live = sum->sites[i].live;
+      st[k].count = sum->sites[i].count;
+      k++;
+    }
+  }
+  free(sum);
+  qsort(st, k, sizeof(xalloc_site_t), xsite_cmp);
+  *n = k;
+
+  return st;
+}
+
+// logs the allocations still outstanding, meant to be called at exit
+void xalloc_report(void) {
+  xalloc_stats_t *sys;
+  xalloc_site_t *st;
+  int i, n;
+
+  if ((sys = xalloc_stats(&n)) != NULL) {
+    debug(DEBUG_INFO, "MEM", "peak %lld bytes, %lld bytes in use, %llu allocations, %llu frees",
+      sys[0].peak, sys[0].live, sys[0].allocs, sys[0].frees);
+    free(sys);
+  }
+
+  if ((st = xalloc_sites(&n)) != NULL) {
+    for (i = 0; i < n && i < XALLOC_REPORT; i++) {
+      debug(DEBUG_INFO, "MEM", "leak %lld bytes in %lld blocks at %s:%d (%s) [%s]",
+        st[i].live, st[i].count, st[i].file, st[i].line, st[i].func, st[i].name);
+    }
+    if (n > XALLOC_REPORT) {
+      debug(DEBUG_INFO, "MEM", "%d more allocation sites with memory in use", n - XALLOC_REPORT);
+    }
+    free(st);
+  }
+}
+
 void *xmemcpy_debug(const char *file, const char *func, int line, void *dest, const void *src, size_t n) {
   void *r = NULL;
 
   if (dest) {
-    //debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory memcpy %08x %08x %d", dest, src ,n);
+    //debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory memcpy %08x %08x %d", dest, src ,n);
     r = memcpy(dest, src, n);
   } else {
     //debug_full(file, func, line, DEBUG_ERROR, "MEM", "memory memcpy null");
@@ -86,7 +923,7 @@ void *xmemset_debug(const char *file, const char *func, int line, void *s, int c
   void *r = NULL;
 
   if (s) {
-    //debug_full(file, func, line, DEBUG_TRACE, "MEM", "memory memset %08x %d %d", s, c, n);
+    //debug_at(file, func, line, DEBUG_TRACE, "MEM", "memory memset %08x %d %d", s, c, n);
     r = memset(s, c, n);
   } else {
     //debug_full(file, func, line, DEBUG_ERROR, "MEM", "memory memset null");
@@ -5,8 +5,25 @@
 extern "C" {
 #endif
 
+typedef struct {
+  char name[16];
+  int64_t live, peak;
+  uint64_t allocs, frees, bytes;
+  double rate;
+} xalloc_stats_t;
+
+typedef struct {
+  const char *file;
+  const char *func;
+  int line;
+  char name[16];
+  int64_t live, count;
+} xalloc_site_t;
+
 void *xmalloc_debug(const char *file, const char *func, int line, size_t size);
 
+void *xmalloc_raw_debug(const char *file, const char *func, int line, size_t size);
+
 void xfree_debug(const char *file, const char *func, int line, void *ptr);
 
 void *xcalloc_debug(const char *file, const char *func, int line, size_t nmemb, size_t size);
@@ -20,7 +37,14 @@ xmemcpy_debug(const char *file, const char *func, int line, void *dest, const vo
 
 void *xmemset_debug(const char *file, const char *func, int line, void *s, int c, size_t n);
 
+xalloc_stats_t *xalloc_stats(int *n);
+
+xalloc_site_t *xalloc_sites(int *n);
+
+void xalloc_report(void);
+
 #define xmalloc(size) xmalloc_debug(__FILE__, __FUNCTION__, __LINE__, size)
+#define xmalloc_raw(size) xmalloc_raw_debug(__FILE__, __FUNCTION__, __LINE__, size)
 #define xfree(ptr) xfree_debug(__FILE__, __FUNCTION__, __LINE__, ptr)
 #define xcalloc(nmemb, size) xcalloc_debug(__FILE__, __FUNCTION__, __LINE__, nmemb, size)
 #define xrealloc(ptr, size) xrealloc_debug(__FILE__, __FUNCTION__, __LINE__, ptr, size)
@@ -27,6 +27,9 @@
 
 #define NUM_BUFFERS 4
 
+// capture buffers always left with the driver, the others may be held by frames
+#define SPARE_BUFFERS 2
+
 #define IO_METHOD_READ    0
 #define IO_METHOD_MMAP    1
 #define IO_METHOD_USERPTR 2
@@ -37,6 +40,7 @@
 typedef struct cam_buffer {
   unsigned char *start;
   size_t length;
+  int held;
 } cam_buffer;
 
 typedef struct {
@@ -46,6 +50,7 @@ typedef struct {
 
 typedef struct {
   mutex_t *mutex;
+  mutex_t *bufmutex;
   char *device;
   int first;
   int fd;
@@ -60,6 +65,7 @@ typedef struct {
   unsigned char *black;
   int blacklen;
   int started;
+  int held, destroyed;
   int64_t t0;
   struct v4l2_capability cap;
   iterator_t iterator;
@@ -101,7 +107,7 @@ static int xioctl(int fd, int request, void *arg, int print_err) {
 static int v4l_cam_select(libv4l_t *data) {
   struct timeval tv;
   fd_set fds, efds;
-  int nfds, n, r;
+  int endfd, finishfd, nfds, n, r;
 
   r = -1;
 
@@ -114,13 +120,30 @@ static int v4l_cam_select(libv4l_t *data) {
     FD_ZERO(&efds);
     FD_SET(data->fd, &fds);
     FD_SET(data->fd, &efds);
+
+    // so that the capture thread does not wait the full timeout to end
+    if ((endfd = thread_get_fd()) != -1) {
+      FD_SET(endfd, &fds);
+      if (endfd >= nfds) nfds = endfd + 1;
+    }
+    if ((finishfd = thread_get_finish_fd()) != -1) {
+      FD_SET(finishfd, &fds);
+      if (finishfd >= nfds) nfds = finishfd + 1;
+    }
+
     n = select(nfds, &fds, NULL, &efds, &tv);
 
     if (n == 0) {
       debug(DEBUG_ERROR, "V4L", "select timeout");
       r = 0;
-    } if (n > 0) {
-      r = 1;
+    } else if (n > 0) {
+      if ((endfd != -1 && FD_ISSET(endfd, &fds)) || (finishfd != -1 && FD_ISSET(finishfd, &fds))) {
+        debug(DEBUG_INFO, "V4L", "select interrupted");
+      } else {
+        r = 1;
+      }
+    } else if (errno == EINTR) {
+      r = 0;
     } else {
       debug_errno("V4L", "select");
     }
@@ -131,10 +154,27 @@ static int v4l_cam_select(libv4l_t *data) {
   return r;
 }
 
+static int v4l_buffer_queue(libv4l_t *data, unsigned int i) {
+  struct v4l2_buffer buf;
+
+  memset(&buf, 0, sizeof(buf));
+  buf.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.index = i;
+
+  if (data->io == IO_METHOD_USERPTR) {
+    buf.memory    = V4L2_MEMORY_USERPTR;
+    buf.m.userptr = (unsigned long)data->buffers[i].start;
+    buf.length    = data->buffers[i].length;
+  } else {
+    buf.memory    = V4L2_MEMORY_MMAP;
+  }
+
+  return xioctl(data->fd, VIDIOC_QBUF, &buf, 1);
+}
+
 static int v4l_cam_start(libv4l_t *data) {
   unsigned int i;
   enum v4l2_buf_type type;
-  struct v4l2_buffer buf;
   int r = 0;
 
   switch (data->io) {
@@ -142,37 +182,12 @@ static int v4l_cam_start(libv4l_t *data) {
       break;
 
     case IO_METHOD_MMAP:
-      for (i = 0; i < data->n_buffers; ++i) {
-        memset(&buf, 0, sizeof(buf));
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = i;
-  
-        if (xioctl(data->fd, VIDIOC_QBUF, &buf, 1) == -1) {
-          debug(DEBUG_ERROR, "V4L", "VIDIOC_QBUF failed (%d / %d) on cam_start", i, data->n_buffers);
-          r = -1;
-          break;
-        }
-      }
-      if (r == -1) break;
-    
-      type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      if (xioctl(data->fd, VIDIOC_STREAMON, &type, 1) == -1) {
-        debug(DEBUG_ERROR, "V4L", "VIDIOC_STREAMON failed");
-        r = -1;
-      }
-      break;
-
     case IO_METHOD_USERPTR:
       for (i = 0; i < data->n_buffers; ++i) {
-        memset(&buf, 0, sizeof(buf));
-        buf.type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory    = V4L2_MEMORY_USERPTR;
-        buf.index     = i;
-        buf.m.userptr = (unsigned long)data->buffers[i].start;
-        buf.length    = data->buffers[i].length;
-
-        if (xioctl(data->fd, VIDIOC_QBUF, &buf, 1) == -1) {
+        // a buffer still held by a frame is queued when the frame releases it
+        if (data->buffers[i].held) continue;
+
+        if (v4l_buffer_queue(data, i) == -1) {
           debug(DEBUG_ERROR, "V4L", "VIDIOC_QBUF failed (%d / %d) on cam_start", i, data->n_buffers);
           r = -1;
           break;
@@ -940,11 +955,91 @@ static int v4l_cam_close(libv4l_t *data) {
   return r;
 }
 
+static void v4l_free(libv4l_t *data) {
+  v4l_cam_close(data);
+  mutex_destroy(data->bufmutex);
+  mutex_destroy(data->mutex);
+  xfree(data->device);
+  xfree(data);
+}
+
+// called when the last frame referencing a capture buffer lets go of it
+static void v4l_buffer_release(unsigned char *buf, void *_data) {
+  libv4l_t *data;
+  unsigned int i;
+  int last;
+
+  data = (libv4l_t *)_data;
+
+  mutex_lock(data->bufmutex);
+  for (i = 0; i < data->n_buffers; i++) {
+    if (data->buffers[i].start == buf) break;
+  }
+  if (i < data->n_buffers && data->buffers[i].held) {
+    data->buffers[i].held = 0;
+    data->held--;
+    if (data->started && v4l_buffer_queue(data, i) == -1) {
+      debug(DEBUG_ERROR, "V4L", "VIDIOC_QBUF failed (%d / %d) on release", i, data->n_buffers);
+    }
+  }
+  last = data->destroyed && data->held == 0;
+  mutex_unlock(data->bufmutex);
+
+  if (last) v4l_free(data);
+}
+
+// Lets the frame reference the capture buffer instead of copying it, unless
+// too few buffers would be left to capture into. Returns 1 if the buffer is
+// now held by the frame, 0 if it was copied and -1 on error.
+static int v4l_frame_buffer(libv4l_t *data, media_frame_t *frame, unsigned int i, int len) {
+  media_buffer_t *b;
+  int hold;
+
+  mutex_lock(data->bufmutex);
+  hold = data->held < (int)data->n_buffers - SPARE_BUFFERS;
+  if (hold) {
+    data->buffers[i].held = 1;
+    data->held++;
+  }
+  mutex_unlock(data->bufmutex);
+
+  if (hold) {
+    if ((b = media_buffer_create(data->buffers[i].start, len, v4l_buffer_release, data)) != NULL) {
+      media_frame_attach(frame, b, len);
+      return 1;
+    }
+    mutex_lock(data->bufmutex);
+    data->buffers[i].held = 0;
+    data->held--;
+    mutex_unlock(data->bufmutex);
+  }
+
+  return media_frame_put(frame, data->buffers[i].start, len);
+}
+
+// The driver stamps the buffer when capture ends, usually with CLOCK_MONOTONIC.
+// The age of the buffer is carried over to sys_get_clock(), which may use
+// another clock.
+static int64_t v4l_capture_time(struct v4l2_buffer *vbuf) {
+  struct timespec ts;
+  int64_t t, age, now;
+
+  now = sys_get_clock();
+
+  if ((vbuf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    t = (int64_t)vbuf->timestamp.tv_sec * 1000000 + vbuf->timestamp.tv_usec;
+    age = ((int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000) - t;
+    if (age >= 0) return now - age;
+  }
+
+  return now;
+}
+
 static int v4l_node_process(media_frame_t *frame, void *_data) {
   libv4l_t *data;
   struct v4l2_buffer vbuf;
   unsigned char *buf;
-  int i, r = -1;
+  int i, held, r = -1;
 
   data = (libv4l_t *)_data;
 
@@ -1005,17 +1100,18 @@ static int v4l_node_process(media_frame_t *frame, void *_data) {
             if (xioctl(data->fd, VIDIOC_DQBUF, &vbuf, 1) != -1) {
               debug(DEBUG_TRACE, "V4L", "VIDIOC_DQBUF ok");
 
+              held = 0;
+              frame->capture = v4l_capture_time(&vbuf);
               if (vbuf.index < data->n_buffers) {
-                buf = data->buffers[vbuf.index].start;
                 r = vbuf.bytesused;
                 if (data->encoding != ENC_JPEG && r != data->blacklen) {
                   debug(DEBUG_ERROR, "V4L", "got only %d/%d bytes from buffer", r, data->blacklen);
                   r = data->blacklen;
                 }
-                if (media_frame_put(frame, buf, r) == -1) r = -1;
+                if ((held = v4l_frame_buffer(data, frame, vbuf.index, r)) == -1) r = -1;
               }
 
-              if (xioctl(data->fd, VIDIOC_QBUF, &vbuf, 1) == -1) {
+              if (held != 1 && xioctl(data->fd, VIDIOC_QBUF, &vbuf, 1) == -1) {
                 debug(DEBUG_ERROR, "V4L", "VIDIOC_QBUF failed (%d / %d) on read_frame", vbuf.index, data->n_buffers);
                 r = -1;
               }
@@ -1037,13 +1133,14 @@ static int v4l_node_process(media_frame_t *frame, void *_data) {
                 if (vbuf.m.userptr == (unsigned long)data->buffers[i].start && vbuf.length == data->buffers[i].length) break;
               }
 
+              held = 0;
+              frame->capture = v4l_capture_time(&vbuf);
               if (i < data->n_buffers) {
-                buf = (unsigned char *)vbuf.m.userptr;
                 r = vbuf.length;
-                if (media_frame_put(frame, buf, r) == -1) r = -1;
+                if ((held = v4l_frame_buffer(data, frame, i, r)) == -1) r = -1;
               }
     
-              if (xioctl(data->fd, VIDIOC_QBUF, &vbuf, 1) == -1) {
+              if (held != 1 && xioctl(data->fd, VIDIOC_QBUF, &vbuf, 1) == -1) {
                 debug(DEBUG_ERROR, "V4L", "VIDIOC_QBUF failed (%d / %d) on read_frame", vbuf.index, data->n_buffers);
                 r = -1;
               }
@@ -1085,6 +1182,7 @@ static int v4l_node_option(char *name, char *value, void *_data) {
 
   if (mutex_lock(data->mutex) == 0) {
     if (!strcmp(name, "start")) {
+      mutex_lock(data->bufmutex);
       if (!data->started) {
         if ((r = v4l_cam_start(data)) == 0) {
           data->started = 1;
@@ -1093,7 +1191,9 @@ static int v4l_node_option(char *name, char *value, void *_data) {
       } else {
         r = 0;
       }
+      mutex_unlock(data->bufmutex);
     } else if (!strcmp(name, "stop")) {
+      mutex_lock(data->bufmutex);
       if (data->started) {
         if ((r = v4l_cam_stop(data)) == 0) {
           data->started = 0;
@@ -1102,6 +1202,7 @@ static int v4l_node_option(char *name, char *value, void *_data) {
       } else {
         r = 0;
       }
+      mutex_unlock(data->bufmutex);
     } else {
       for (i = 0; v4l_op_name[i]; i++) {
         if (!strcmp(v4l_op_name[i], name)) {
@@ -1120,15 +1221,21 @@ static int v4l_node_option(char *name, char *value, void *_data) {
 
 static int v4l_node_destroy(void *_data) {
   libv4l_t *data;
+  int last;
 
   data = (libv4l_t *)_data;
 
-  v4l_cam_stop(data);
-  v4l_cam_close(data);
   ptr_free(data->it, TAG_ITERATOR);
-  mutex_destroy(data->mutex);
-  xfree(data->device);
-  xfree(data);
+
+  // the device stays open while frames still hold capture buffers
+  mutex_lock(data->bufmutex);
+  v4l_cam_stop(data);
+  data->started = 0;
+  data->destroyed = 1;
+  last = data->held == 0;
+  mutex_unlock(data->bufmutex);
+
+  if (last) v4l_free(data);
 
   return 0;
 }
@@ -1151,6 +1258,7 @@ static int libv4l_node(int pe) {
 
     if ((data = xcalloc(1, sizeof(libv4l_t))) != NULL) {
       data->mutex = mutex_create("v4l");
+      data->bufmutex = mutex_create("v4l_buffer");
       data->fd = -1;
       data->device = device;
       data->encoding = encoding;
@@ -1177,6 +1285,7 @@ static int libv4l_node(int pe) {
           r = script_push_integer(pe, node);
         }
       } else {
+        mutex_destroy(data->bufmutex);
         mutex_destroy(data->mutex);
         xfree(data->device);
         xfree(data);
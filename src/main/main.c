@@ -13,6 +13,8 @@
 #include "sys.h"
 #include "vfs.h"
 #include "ptr.h"
+#include "mutex.h"
+#include "trace.h"
 #include "sig.h"
 #include "endianness.h"
 #include "debug.h"
@@ -29,9 +31,9 @@ static void idle_loop(void) {
 }
 
 int pit_main(int argc, char *argv[]) {
-  char *script_engine, *debugfile;
+  char *script_engine, *debugfile, *tracefile;
   char *match_function;
-  int pe, background, dlevel, err, i;
+  int pe, background, profile, async, dlevel, wait_timeout, err, i;
   int script_argc, status;
   char **script_argv, *d, *s;
 
@@ -39,8 +41,12 @@ int pit_main(int argc, char *argv[]) {
   script_argc = 0;
   script_argv = NULL;
   background = 0;
+  profile = 0;
+  async = 0;
   debugfile = NULL;
+  tracefile = NULL;
   match_function = NULL;
+  wait_timeout = -1;
   err = 0;
 
   for (i = 1; i < argc && !err; i++) {
@@ -72,6 +78,20 @@ int pit_main(int argc, char *argv[]) {
           case 'm':
             match_function = argv[++i];
             break;
+          case 'w':
+            wait_timeout = atoi(argv[++i]);
+            // the timeout is kept in us
+            if (wait_timeout < 0 || (uint32_t)wait_timeout > UINT32_MAX / 1000000) err = 1;
+            break;
+          case 'p':
+            profile = 1;
+            break;
+          case 'a':
+            async = 1;
+            break;
+          case 'r':
+            tracefile = argv[++i];
+            break;
           default:
             err = 1;
         }
@@ -87,7 +107,7 @@ int pit_main(int argc, char *argv[]) {
 
   if (err || script_engine == NULL || script_argv == NULL) {
     fprintf(stderr, "%s\n", SYSTEM_NAME);
-    fprintf(stderr, "usage: %s [ -b ] [ -f <debugfile> ] [ -d level ] -s <libname.so> [ <script> <arg> ... ]\n", argv[0]);
+    fprintf(stderr, "usage: %s [ -b ] [ -p ] [ -a ] [ -f <debugfile> ] [ -r <tracefile> ] [ -d level ] [ -w <seconds> ] -s <libname.so> [ <script> <arg> ... ]\n", argv[0]);
     return STATUS_ERROR;
   }
 
@@ -95,6 +115,9 @@ int pit_main(int argc, char *argv[]) {
   debug_init(debugfile);
   ptr_init();
   thread_init();
+  if (wait_timeout >= 0) thread_set_wait_timeout((uint32_t)wait_timeout * 1000000u);
+  if (profile) mutex_profile(1);
+  if (tracefile) trace_start(0);
 
   debug(DEBUG_INFO, "MAIN", "%s starting on %s (%s endian)", SYSTEM_NAME, SYSTEM_OS, little_endian() ? "little" : "big");
 
@@ -102,6 +125,7 @@ int pit_main(int argc, char *argv[]) {
     debug_close();
     return STATUS_ERROR;
   }
+  if (async) debug_async(1);
   thread_setmain();
 
   sys_unblock_signals();
@@ -142,13 +166,17 @@ int pit_main(int argc, char *argv[]) {
     sys_set_finish(STATUS_ERROR);
   }
 
-  sys_usleep(1000); // give threads a chance to increment thread count
   thread_wait_all();
   script_destroy(pe);
   script_finish();
   vfs_finish();
   status = thread_get_status();
   thread_close();
+  if (tracefile) {
+    trace_stop();
+    trace_export(tracefile);
+  }
+  xalloc_report();
   debug(DEBUG_INFO, "MAIN", "%s stopping", SYSTEM_NAME);
   debug_close();
 